@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#ifndef PMEMOBJ_NRHI_BUCKET_PROBE_HPP
+#define PMEMOBJ_NRHI_BUCKET_PROBE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace pmem
+{
+namespace obj
+{
+namespace nrhi
+{
+
+/**
+ * Geometry of the buckets of a table: Slots 64-bit slots per bucket, and
+ * buckets aligned to Align bytes, which pads them if Align is larger. A
+ * bucket is probed as one unit whatever its size, its slots share the
+ * bits of one probe_mask.
+ */
+template <size_t Slots = 8, size_t Align = Slots * sizeof(uint64_t)>
+struct bucket_geometry {
+	static_assert(Slots == 4 || Slots == 8 || Slots == 16 || Slots == 32,
+		      "a bucket holds 4, 8, 16 or 32 slots");
+	static_assert((Align & (Align - 1)) == 0,
+		      "buckets are aligned to a power of two");
+	/* an inline entry, a slot pair, then never straddles cache lines */
+	static_assert(Align >= 2 * sizeof(uint64_t),
+		      "buckets are aligned to 16 bytes at least");
+
+	static const size_t slots = Slots;
+	static const size_t alignment = Align;
+};
+
+/* one cache line per bucket, the default */
+using cacheline_geometry = bucket_geometry<8, 64>;
+/* four cache lines per bucket, the 256-byte write unit of Optane DCPMM */
+using xpline_geometry = bucket_geometry<32, 256>;
+
+/**
+ * Result of probing a bucket, bit i stands for slot i.
+ */
+struct probe_mask {
+	/* slots holding an item whose token equals the probed one */
+	uint32_t match;
+	/* slots holding no item */
+	uint32_t empty;
+};
+
+/* bits of a slot encoding the offset of the item, see compound_pool_ptr */
+static const uint64_t probe_offset_mask = 0x0000FFFFFFFFFFFC;
+/* the token lives in the top 16 bits of a slot */
+static const unsigned probe_token_shift = 48;
+static const uint64_t probe_token_mask = 0xFFFF000000000000;
+
+/**
+ * Probe the eight slots of a bucket for a token in one pass.
+ *
+ * The kernel is chosen at compile time: AVX-512 if available, then
+ * AVX2, then a scalar loop. Slots are read with unaligned loads since
+ * the PM allocator does not guarantee cache line aligned arrays.
+ */
+inline probe_mask
+probe_bucket(const uint64_t *slots, uint16_t token)
+{
+	probe_mask m;
+#if defined(__AVX512F__)
+	__m512i v = _mm512_loadu_si512((const void *)slots);
+	__mmask8 empty = _mm512_testn_epi64_mask(
+		v, _mm512_set1_epi64((long long)probe_offset_mask));
+	__mmask8 tokens = _mm512_cmpeq_epi64_mask(
+		_mm512_and_si512(v,
+				 _mm512_set1_epi64((long long)probe_token_mask)),
+		_mm512_set1_epi64(
+			(long long)((uint64_t)token << probe_token_shift)));
+	m.empty = (uint32_t)empty;
+	m.match = (uint32_t)(tokens & ~empty) & 0xFF;
+#elif defined(__AVX2__)
+	const __m256i off_mask =
+		_mm256_set1_epi64x((long long)probe_offset_mask);
+	const __m256i tok = _mm256_set1_epi64x((long long)token);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_loadu_si256((const __m256i *)slots);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(slots + 4));
+
+	__m256i e_lo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, off_mask), zero);
+	__m256i e_hi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, off_mask), zero);
+	__m256i t_lo = _mm256_cmpeq_epi64(
+		_mm256_srli_epi64(lo, probe_token_shift), tok);
+	__m256i t_hi = _mm256_cmpeq_epi64(
+		_mm256_srli_epi64(hi, probe_token_shift), tok);
+
+	m.empty = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(e_lo)) |
+		((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(e_hi))
+		 << 4);
+	uint32_t tokens =
+		(uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(t_lo)) |
+		((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(t_hi))
+		 << 4);
+	m.match = tokens & ~m.empty;
+#else
+	m.match = 0;
+	m.empty = 0;
+	for (unsigned i = 0; i < 8; i++) {
+		uint64_t s = slots[i];
+		if ((s & probe_offset_mask) == 0)
+			m.empty |= 1U << i;
+		else if ((uint16_t)(s >> probe_token_shift) == token)
+			m.match |= 1U << i;
+	}
+#endif
+	return m;
+}
+
+/**
+ * Probe the Slots slots of a bucket for a token, eight slots at a time
+ * with probe_bucket().
+ */
+template <size_t Slots>
+inline probe_mask
+probe_slots(const uint64_t *slots, uint16_t token)
+{
+	probe_mask m = probe_bucket(slots, token);
+	for (size_t i = 8; i < Slots; i += 8) {
+		probe_mask n = probe_bucket(slots + i, token);
+		m.match |= n.match << i;
+		m.empty |= n.empty << i;
+	}
+	return m;
+}
+
+template <>
+inline probe_mask
+probe_slots<4>(const uint64_t *slots, uint16_t token)
+{
+	probe_mask m;
+	m.match = 0;
+	m.empty = 0;
+	for (unsigned i = 0; i < 4; i++) {
+		uint64_t s = slots[i];
+		if ((s & probe_offset_mask) == 0)
+			m.empty |= 1U << i;
+		else if ((uint16_t)(s >> probe_token_shift) == token)
+			m.match |= 1U << i;
+	}
+	return m;
+}
+
+} /* namespace nrhi */
+} /* namespace obj */
+} /* namespace pmem */
+
+#endif /* PMEMOBJ_NRHI_BUCKET_PROBE_HPP */
@@ -15,6 +15,8 @@ parse_cli_op(const char *op)
 		return OP::PUT;
 	} else if (!strcmp(op, "get")) {
 		return OP::GET;
+	} else if (!strcmp(op, "set")) {
+		return OP::UPDATE;
 	} else if (!strcmp(op, "free")) {
 		return OP::DELETE;
 	} else if (!strcmp(op, "help")) {
@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#ifndef PMEMOBJ_NRHI_EPOCH_HPP
+#define PMEMOBJ_NRHI_EPOCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace pmem
+{
+namespace obj
+{
+namespace nrhi
+{
+
+/* upper bound of threads operating on tables at the same time */
+static const size_t epoch_max_threads = 1024;
+/* values a thread retires before trying to reclaim them */
+static const size_t epoch_retire_batch = 64;
+/* epochs a thread pins for references outliving its operations */
+static const size_t epoch_holds = 4;
+/* alignment of state written by one thread and read by the others */
+static const size_t cache_line_bytes = 64;
+
+/**
+ * Base of objects holding cache line aligned members. new ignores
+ * extended alignment before C++17, so objects are allocated aligned here.
+ */
+struct cache_aligned {
+	static void *
+	operator new(size_t n)
+	{
+		return alloc(n);
+	}
+
+	static void *
+	operator new[](size_t n)
+	{
+		return alloc(n);
+	}
+
+	static void
+	operator delete(void *ptr) noexcept
+	{
+		std::free(ptr);
+	}
+
+	static void
+	operator delete[](void *ptr) noexcept
+	{
+		std::free(ptr);
+	}
+
+private:
+	static void *
+	alloc(size_t n)
+	{
+		void *ptr = nullptr;
+		if (posix_memalign(&ptr, cache_line_bytes, n ? n : 1) != 0)
+			throw std::bad_alloc();
+		return ptr;
+	}
+};
+
+/**
+ * Dense id of the calling thread, recycled when the thread exits so that
+ * per-thread arrays stay bounded.
+ */
+class thread_id {
+public:
+	static size_t
+	get()
+	{
+		static thread_local thread_id id;
+		return id.idx;
+	}
+
+	/**
+	 * Get an upper bound of the ids handed out so far, so that
+	 * per-thread arrays are read only up to it.
+	 */
+	static size_t
+	limit()
+	{
+		size_t n = next_id().load(std::memory_order_acquire);
+		return n < epoch_max_threads ? n : epoch_max_threads;
+	}
+
+private:
+	size_t idx;
+
+	thread_id()
+	{
+		std::lock_guard<std::mutex> lock(ids_lock());
+		std::vector<size_t> &ids = free_ids();
+		if (ids.empty()) {
+			idx = next_id().fetch_add(1, std::memory_order_release);
+		} else {
+			idx = ids.back();
+			ids.pop_back();
+		}
+		if (idx >= epoch_max_threads)
+			throw std::length_error("too many threads");
+	}
+
+	~thread_id()
+	{
+		std::lock_guard<std::mutex> lock(ids_lock());
+		free_ids().push_back(idx);
+	}
+
+	static std::mutex &
+	ids_lock()
+	{
+		static std::mutex lock;
+		return lock;
+	}
+
+	static std::vector<size_t> &
+	free_ids()
+	{
+		static std::vector<size_t> ids;
+		return ids;
+	}
+
+	static std::atomic<size_t> &
+	next_id()
+	{
+		static std::atomic<size_t> next(0);
+		return next;
+	}
+};
+
+/**
+ * Epoch based reclamation of memory reachable by concurrent operations.
+ *
+ * An operation pins the global epoch while it runs. Memory unlinked from
+ * the table may be freed once synchronize() returns, since every operation
+ * that could still see it has left by then, or be retired to be freed
+ * later without waiting. This object keeps per-thread state written by
+ * every operation, so it must live in DRAM.
+ */
+class epoch_manager : public cache_aligned {
+public:
+	epoch_manager() : global(1)
+	{
+		for (size_t i = 0; i < epoch_max_threads; i++) {
+			slots[i].epoch.store(0, std::memory_order_relaxed);
+			slots[i].depth = 0;
+			for (size_t k = 0; k < epoch_holds; k++) {
+				slots[i].holds[k].epoch.store(
+					0, std::memory_order_relaxed);
+				slots[i].holds[k].count = 0;
+			}
+		}
+	}
+
+	epoch_manager(const epoch_manager &) = delete;
+	epoch_manager &operator=(const epoch_manager &) = delete;
+
+	/**
+	 * Pin the current epoch, may be nested.
+	 */
+	void
+	enter()
+	{
+		slot &s = slots[thread_id::get()];
+		if (s.depth++ != 0)
+			return;
+		s.epoch.store(global.load(std::memory_order_acquire),
+			      std::memory_order_relaxed);
+		/* order the pin before any read of shared memory */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void
+	exit()
+	{
+		slot &s = slots[thread_id::get()];
+		if (--s.depth == 0)
+			s.epoch.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * Keep the memory the running operation of the calling thread may
+	 * have seen, or everything if none runs, until unhold(). Unlike
+	 * enter(), a hold does not keep later operations of the thread at
+	 * an old epoch.
+	 * @return the hold, released by the same thread.
+	 */
+	size_t
+	hold()
+	{
+		slot &s = slots[thread_id::get()];
+		uint64_t e = s.depth
+			? s.epoch.load(std::memory_order_relaxed)
+			: global.load(std::memory_order_acquire);
+		return hold(s, e);
+	}
+
+	/**
+	 * Hold the epoch of a hold of the calling thread once more.
+	 */
+	size_t
+	hold(size_t h)
+	{
+		slot &s = slots[thread_id::get()];
+		return hold(s,
+			    s.holds[h].epoch.load(std::memory_order_relaxed));
+	}
+
+	void
+	unhold(size_t h)
+	{
+		hold_record &r = slots[thread_id::get()].holds[h];
+		if (--r.count == 0)
+			r.epoch.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * Throw if the calling thread runs an operation or holds an epoch,
+	 * since synchronize() would then wait for itself.
+	 */
+	void
+	check_unpinned()
+	{
+		slot &s = slots[thread_id::get()];
+		bool held = s.depth != 0;
+		for (size_t k = 0; k < epoch_holds; k++)
+			held = held || s.holds[k].count != 0;
+		if (held)
+			throw std::logic_error(
+				"waiting for readers while holding an item");
+	}
+
+	/**
+	 * Wait until every operation that may have seen memory unlinked
+	 * before the call has left, and every hold taken by then is
+	 * released. The calling thread must hold nothing.
+	 */
+	void
+	synchronize()
+	{
+		check_unpinned();
+		uint64_t e = global.fetch_add(1) + 1;
+		size_t n = thread_id::limit();
+		for (size_t i = 0; i < n; i++) {
+			while (oldest_pin(slots[i]) < e)
+				std::this_thread::yield();
+		}
+	}
+
+	/* frees a retired value, given the context it was retired with */
+	using free_fn = void (*)(void *ctx, uint64_t value);
+
+	/**
+	 * Hand a value unlinked by the calling thread to free(ctx, value)
+	 * once no operation that may have seen it is left. Values are kept
+	 * in a list of the thread and reclaimed every epoch_retire_batch
+	 * retirements.
+	 */
+	void
+	retire(uint64_t value, free_fn free, void *ctx)
+	{
+		slot &s = slots[thread_id::get()];
+		s.retired.push_back(
+			retired_value{global.load(std::memory_order_acquire),
+				      value, free, ctx});
+		if (s.retired.size() % epoch_retire_batch == 0)
+			reclaim(s);
+	}
+
+	/**
+	 * Free the values retired by every thread, none of which may be
+	 * running an operation.
+	 */
+	void
+	reclaim_all()
+	{
+		size_t n = thread_id::limit();
+		for (size_t i = 0; i < n; i++) {
+			for (auto &r : slots[i].retired)
+				r.free(r.ctx, r.value);
+			slots[i].retired.clear();
+		}
+	}
+
+	/* pins the epoch for the lifetime of a scope */
+	class guard {
+	public:
+		explicit guard(epoch_manager &r_em) : em(r_em)
+		{
+			em.enter();
+		}
+
+		~guard()
+		{
+			em.exit();
+		}
+
+	private:
+		epoch_manager &em;
+	};
+
+private:
+	struct retired_value {
+		/* global epoch when the value was retired */
+		uint64_t epoch;
+		uint64_t value;
+		free_fn free;
+		void *ctx;
+	};
+
+	/* epoch kept by count holds of a thread, 0 when unused */
+	struct hold_record {
+		std::atomic<uint64_t> epoch;
+		size_t count;
+	};
+
+	struct alignas(cache_line_bytes) slot {
+		/* epoch pinned by the thread, 0 when quiescent */
+		std::atomic<uint64_t> epoch;
+		size_t depth;
+		std::vector<retired_value> retired;
+		hold_record holds[epoch_holds];
+	};
+
+	/**
+	 * Take a hold of epoch e, sharing the record of an equal epoch, or
+	 * a free one, or else the record of the oldest epoch.
+	 */
+	size_t
+	hold(slot &s, uint64_t e)
+	{
+		size_t unused = epoch_holds, oldest = 0;
+		for (size_t k = 0; k < epoch_holds; k++) {
+			hold_record &r = s.holds[k];
+			uint64_t held = r.epoch.load(std::memory_order_relaxed);
+			if (r.count != 0 && held == e) {
+				r.count++;
+				return k;
+			}
+			if (r.count == 0 && unused == epoch_holds)
+				unused = k;
+			if (held < s.holds[oldest].epoch.load(
+					   std::memory_order_relaxed))
+				oldest = k;
+		}
+		size_t k = unused != epoch_holds ? unused : oldest;
+		hold_record &r = s.holds[k];
+		if (r.count == 0 ||
+		    e < r.epoch.load(std::memory_order_relaxed)) {
+			r.epoch.store(e, std::memory_order_relaxed);
+			/* order the hold before any read of shared memory,
+			 * a running operation already keeps e */
+			if (s.depth == 0)
+				std::atomic_thread_fence(
+					std::memory_order_seq_cst);
+		}
+		r.count++;
+		return k;
+	}
+
+	/* oldest epoch the thread of s keeps, UINT64_MAX if none */
+	static uint64_t
+	oldest_pin(const slot &s)
+	{
+		uint64_t oldest = s.epoch.load(std::memory_order_acquire);
+		if (oldest == 0)
+			oldest = UINT64_MAX;
+		for (size_t k = 0; k < epoch_holds; k++) {
+			uint64_t held = s.holds[k].epoch.load(
+				std::memory_order_acquire);
+			if (held != 0 && held < oldest)
+				oldest = held;
+		}
+		return oldest;
+	}
+
+	/**
+	 * Free the values of a retire list that no pinned operation may
+	 * still see. An operation pinned at the epoch a value was retired
+	 * in may have seen it; the epoch is advanced so that operations
+	 * starting afterwards do not hold the next batch back.
+	 */
+	void
+	reclaim(slot &s)
+	{
+		uint64_t oldest = global.fetch_add(1) + 1;
+		size_t n = thread_id::limit();
+		for (size_t i = 0; i < n; i++) {
+			uint64_t pinned = oldest_pin(slots[i]);
+			if (pinned < oldest)
+				oldest = pinned;
+		}
+
+		size_t kept = 0;
+		for (size_t k = 0; k < s.retired.size(); k++) {
+			if (s.retired[k].epoch < oldest)
+				s.retired[k].free(s.retired[k].ctx,
+						  s.retired[k].value);
+			else
+				s.retired[kept++] = s.retired[k];
+		}
+		s.retired.resize(kept);
+	}
+
+	std::atomic<uint64_t> global;
+	slot slots[epoch_max_threads];
+};
+
+} /* namespace nrhi */
+} /* namespace obj */
+} /* namespace pmem */
+
+#endif /* PMEMOBJ_NRHI_EPOCH_HPP */
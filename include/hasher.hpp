@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#ifndef PMEMOBJ_NRHI_HASHER_HPP
+#define PMEMOBJ_NRHI_HASHER_HPP
+
+#include <libpmemobj++/p.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#include "xxhash.hpp"
+
+namespace pmem
+{
+namespace obj
+{
+namespace nrhi
+{
+
+/**
+ * Finalizer of MurmurHash3, every bit of k flips each bit of the result
+ * with a probability close to 1/2.
+ */
+static inline uint64_t
+fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/**
+ * Default hasher of NRHI tables. std::hash is the identity for integers
+ * in libstdc++, while NRHI picks segments and tokens from the top bits of
+ * hash codes, so integers are mixed by fmix64() instead. Other keys go
+ * through std::hash.
+ */
+template <typename Key, typename = void>
+struct default_hash : std::hash<Key> {
+};
+
+template <typename Key>
+struct default_hash<Key,
+		    typename std::enable_if<std::is_integral<Key>::value ||
+					    std::is_enum<Key>::value>::type> {
+	size_t
+	operator()(Key key) const
+	{
+		return (size_t)fmix64((uint64_t)key);
+	}
+};
+
+template <typename T>
+struct default_hash<p<T>> {
+	size_t
+	operator()(const p<T> &key) const
+	{
+		return default_hash<T>()(key.get_ro());
+	}
+};
+
+/* seed of xxh3_seeded unless given one */
+static const uint64_t xxh3_default_seed = 0x9e3779b97f4a7c15;
+
+/**
+ * Keying of XXH3 with its default secret and a seed.
+ */
+template <uint64_t Seed = xxh3_default_seed>
+struct xxh3_seeded {
+	static const uint8_t *
+	secret()
+	{
+		return XXH3_kSecret;
+	}
+
+	static size_t
+	secret_size()
+	{
+		return sizeof(XXH3_kSecret);
+	}
+
+	static uint64_t
+	seed()
+	{
+		return Seed;
+	}
+
+	static uint64_t
+	hash(const void *data, size_t len)
+	{
+		return XXH3_64bits_withSeed(data, len, Seed);
+	}
+};
+
+/**
+ * Keying of XXH3 with a secret of Secret::size() random bytes at
+ * Secret::data(), at least XXH3_SECRET_SIZE_MIN of them.
+ */
+template <typename Secret>
+struct xxh3_secret {
+	static const uint8_t *
+	secret()
+	{
+		return static_cast<const uint8_t *>(Secret::data());
+	}
+
+	static size_t
+	secret_size()
+	{
+		return Secret::size();
+	}
+
+	static uint64_t
+	seed()
+	{
+		return 0;
+	}
+
+	static uint64_t
+	hash(const void *data, size_t len)
+	{
+		return XXH3_64bits_withSecret(data, len, Secret::data(),
+					      Secret::size());
+	}
+};
+
+/**
+ * XXH3 of keys of Len bytes. The specializations call the short input
+ * kernel of that length directly, so it is inlined with the length
+ * folded in, and give the same hash codes as Keying::hash().
+ */
+template <size_t Len, typename Keying>
+struct xxh3_fixed {
+	static uint64_t
+	hash(const void *data)
+	{
+		return Keying::hash(data, Len);
+	}
+};
+
+template <typename Keying>
+struct xxh3_fixed<8, Keying> {
+	static uint64_t
+	hash(const void *data)
+	{
+		return XXH3_len_4to8_64b(static_cast<const xxh_u8 *>(data), 8,
+					 Keying::secret(), Keying::seed());
+	}
+};
+
+template <typename Keying>
+struct xxh3_fixed<16, Keying> {
+	static uint64_t
+	hash(const void *data)
+	{
+		return XXH3_len_9to16_64b(static_cast<const xxh_u8 *>(data), 16,
+					  Keying::secret(), Keying::seed());
+	}
+};
+
+template <typename Keying>
+struct xxh3_fixed<32, Keying> {
+	static uint64_t
+	hash(const void *data)
+	{
+		return XXH3_len_17to128_64b(static_cast<const xxh_u8 *>(data),
+					    32, Keying::secret(),
+					    Keying::secret_size(),
+					    Keying::seed());
+	}
+};
+
+/**
+ * Equality of string-like keys by their bytes, so that polymorphic_string,
+ * std::string and std::string_view keys compare with each other.
+ */
+struct bytes_equal {
+	template <typename A, typename B>
+	bool
+	operator()(const A &lhs, const B &rhs) const
+	{
+		return lhs.size() == rhs.size() &&
+			std::memcmp(bytes_of(lhs, 0), bytes_of(rhs, 0),
+				    lhs.size()) == 0;
+	}
+
+	/* c_str() where there is one, polymorphic_string has no data() */
+	template <typename S>
+	static auto
+	bytes_of(const S &s, int) -> decltype(s.c_str())
+	{
+		return s.c_str();
+	}
+
+	template <typename S>
+	static auto
+	bytes_of(const S &s, long) -> decltype(s.data())
+	{
+		return s.data();
+	}
+};
+
+/**
+ * Hasher of string-like keys with XXH3, transparent across the key types
+ * of bytes_equal. Keys of KeyLen bytes, if not 0, take the path of
+ * xxh3_fixed, all others the generic one, with the same hash codes.
+ * Keying is xxh3_seeded or xxh3_secret.
+ */
+template <size_t KeyLen = 0, typename Keying = xxh3_seeded<>>
+class xxh3_hasher {
+public:
+	using transparent_key_equal = bytes_equal;
+
+	template <typename S>
+	size_t
+	operator()(const S &key) const
+	{
+		return hash(bytes_equal::bytes_of(key, 0), key.size());
+	}
+
+	static uint64_t
+	hash(const void *data, size_t len)
+	{
+		if (KeyLen != 0 && len == KeyLen)
+			return xxh3_fixed<KeyLen, Keying>::hash(data);
+		return Keying::hash(data, len);
+	}
+};
+
+} /* namespace nrhi */
+} /* namespace obj */
+} /* namespace pmem */
+
+#endif /* PMEMOBJ_NRHI_HASHER_HPP */
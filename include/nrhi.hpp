@@ -12,20 +12,30 @@
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
 #include <functional>
 #include <initializer_list>
+#include <iostream>
 #include <iterator>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <type_traits>
 #include <typeinfo>
-#include <unordered_map>
 #include <vector>
 
+#include "bucket_probe.hpp"
 #include "compound_pool_ptr.hpp"
+#include "epoch.hpp"
+#include "hasher.hpp"
+#include "slab.hpp"
+#include "snapshot.hpp"
 
 #if _MSC_VER
 #include <intrin.h>
@@ -37,6 +47,7 @@
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #define ALIGNED(N) __attribute__((aligned(N)))
+#define PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
 #define CACHE_LINE_SIZE 64
 
 // #define DEBUG
@@ -97,8 +108,43 @@ make_persistent_object(pool_base &pop, persistent_ptr<U> &ptr, Args &&...args)
 #endif
 }
 
-template <typename Key, typename T, typename Hash = std::hash<Key>,
-	  typename KeyEqual = std::equal_to<Key>>
+/**
+ * Whether objects of type T may be copied into a bucket byte by byte.
+ * p<T> is looked through since its assignment operator only exists for
+ * transactional snapshotting.
+ */
+template <typename T>
+struct is_inline_storable : std::is_trivially_copyable<T> {
+};
+
+template <typename T>
+struct is_inline_storable<const T> : is_inline_storable<T> {
+};
+
+template <typename T>
+struct is_inline_storable<p<T>> : is_inline_storable<T> {
+};
+
+/* integer type fetch_add() adds to, for integral values and their p<> */
+template <typename T, typename = void>
+struct counter_of {
+};
+
+template <typename T>
+struct counter_of<T,
+		  typename std::enable_if<std::is_integral<T>::value>::type> {
+	using type = T;
+};
+
+template <typename T>
+struct counter_of<p<T>,
+		  typename std::enable_if<std::is_integral<T>::value>::type> {
+	using type = T;
+};
+
+template <typename Key, typename T, typename Hash = default_hash<Key>,
+	  typename KeyEqual = std::equal_to<Key>,
+	  typename Geometry = cacheline_geometry>
 class NRHI {
 public:
 	using key_type = Key;
@@ -116,22 +162,105 @@ public:
 	using kv_ptr_t = detail::compound_pool_ptr<value_type>;
 
 	static const size_type hashcode_size = sizeof(uint64_t) * 8;
-	static const size_type slots_num = 8;
-	static const size_type partial_shift = sizeof(partial_t) * 8;
+	static const size_type slots_num = Geometry::slots;
 	static const size_type token_shift =
 		(sizeof(hashcode_t) - sizeof(partial_t)) * 8;
 	static const size_type partial_mask = 0xFFFF000000000000;
 	static const size_type segment_shift = 24;
+	/* number of keys whose PM misses are overlapped by find_batch */
+	static const size_type batch_size = 16;
+	/* hash codes debug builds look at, see check_hash() */
+	static const size_type hash_check_samples = 1024;
+	/* buckets a scan prefetches ahead of the one it reads */
+	static const size_type scan_prefetch = 4;
+	/* upper bound of layers, segs_power grows by EXPO per layer */
+	static const size_type max_layers = 64;
+
+	/*
+	 * Items of trivially copyable types fitting in a slot are stored
+	 * inline: an entry is a header slot (token, busy and commit bits)
+	 * followed by a payload slot holding the item itself, so neither an
+	 * allocation nor a second PM miss is needed. Otherwise an entry is a
+	 * single slot pointing to an out-of-line item.
+	 */
+	static const bool inline_kv = is_inline_storable<Key>::value &&
+		is_inline_storable<T>::value &&
+		sizeof(value_type) <= sizeof(uint64_t);
+	/* larger trivially copyable items are copied into slab records */
+	static const bool slab_kv = !inline_kv &&
+		is_inline_storable<Key>::value && is_inline_storable<T>::value;
+	/* out-of-line values one atomic instruction updates in place */
+	static const bool word_value = !inline_kv &&
+		is_inline_storable<T>::value &&
+		(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 ||
+		 sizeof(T) == 8) &&
+		alignof(T) >= sizeof(T);
+	static const size_type entry_slots = inline_kv ? 2 : 1;
+	static const size_type entries_num = slots_num / entry_slots;
+	/* slots an entry may start at */
+	static const uint32_t entry_mask = (uint32_t)(
+		(inline_kv ? 0x5555555555555555ULL : ~0ULL) &
+		((1ULL << slots_num) - 1));
+	/* header bits of an inline entry, non-zero offset bits when busy */
+	static const uint64_t inline_busy = 0x4;
+	static const uint64_t inline_commit = 0x8;
+	/* uncommitted headers carry the run they were claimed in */
+	static const size_type inline_run_shift = 16;
+	static const uint64_t inline_run_mask = 0xFFFFFFFF;
+	/* marker state of a slot whose entry is being moved by the migrator */
+	static const uint8_t moving_marker = 1;
+	/* marker state of a segment checked for reclamation by shrink() */
+	static const uint8_t retiring_marker = 1;
+	/* segments shrink() reclaims per grace period */
+	static const size_type reclaim_batch = 16;
+	/* load factor bulk_load() allocates segments for */
+	static const size_type bulk_fill_percent = 75;
+	/* bytes of records import_snapshot() decodes per batch */
+	static const size_type import_batch_bytes = 64 << 20;
+	/* buckets per segment geometry_for() grows up to, 2^10 x 64B */
+	static const size_type max_hashpower = 10;
+	/* bucket arrays kept allocated for expand(), see start_refiller() */
+	static const size_type reservoir_size = 16;
+	/* bytes of the pool a bit of the recover() reachability map covers */
+	static const size_type reach_unit = 64;
+	/* revision of the persistent image, see layout_word() */
+	static const uint64_t layout_revision = 1;
 
+	/**
+	 * Reference to an item of the table.
+	 *
+	 * While it holds an item, an accessor keeps the epoch the item was
+	 * found in, so the item is not reclaimed even if it is erased or
+	 * replaced meanwhile. Since that also holds back the reclamation of
+	 * everything retired later, an accessor should be released soon. It
+	 * must be released, or destroyed, by the thread that filled it and
+	 * before the table, and that thread may not call shrink() or
+	 * consolidate() while holding it.
+	 *
+	 * An inline item lives in its bucket slot, which an erase and an
+	 * insert, or a move of the migrator, may refill while the accessor
+	 * holds it. Every access reads the whole item in one load and
+	 * returns that copy, so it sees the item found or a replacement but
+	 * never a mix of both, and writes through it do not reach the table.
+	 * Copy *a to read the key and value of the same item.
+	 */
 	class accessor {
-		friend class NRHI<Key, T, Hash, KeyEqual>;
+		friend class NRHI<Key, T, Hash, KeyEqual, Geometry>;
 		kv_ptr_t kv_p;
 		uint64_t pool_uuid;
+		epoch_manager *em;
+		/* hold of em keeping the item */
+		size_t pin;
+		/* last copy read of an inline item */
+		uint64_t item;
 
 		void
-		set(uint64_t r_pool_uuid, kv_ptr_t r_kv_p)
+		set(const NRHI *map, kv_ptr_t r_kv_p)
 		{
-			pool_uuid = r_pool_uuid;
+			release();
+			em = &map->rt->epochs;
+			pin = em->hold();
+			pool_uuid = map->my_pool_uuid;
 			kv_p = r_kv_p;
 		}
 
@@ -152,16 +281,130 @@ public:
 		operator->()
 		{
 			assert(kv_p);
-			return kv_p.get_address(pool_uuid);
+			pointer p = kv_p.get_address(pool_uuid);
+			if (!inline_kv)
+				return p;
+			static_assert(!inline_kv ||
+					      sizeof(value_type) <=
+						      sizeof(item),
+				      "an inline item is read in one load");
+			item = __atomic_load_n(reinterpret_cast<uint64_t *>(p),
+					       __ATOMIC_ACQUIRE);
+			return reinterpret_cast<pointer>(&item);
+		}
+
+		accessor() : kv_p(OID_NULL), em(nullptr), pin(0), item(0)
+		{
 		}
 
-		accessor() : kv_p(OID_NULL)
+		accessor(const accessor &r)
+		    : kv_p(r.kv_p),
+		      pool_uuid(r.pool_uuid),
+		      em(r.em),
+		      pin(0),
+		      item(0)
 		{
+			if (em)
+				pin = em->hold(r.pin);
+		}
+
+		accessor &
+		operator=(const accessor &r)
+		{
+			if (this != &r) {
+				size_t p = r.em ? r.em->hold(r.pin) : 0;
+				release();
+				kv_p = r.kv_p;
+				pool_uuid = r.pool_uuid;
+				em = r.em;
+				pin = p;
+			}
+			return *this;
 		}
 
 		~accessor()
+		{
+			release();
+		}
+
+		/**
+		 * Drop the item, which may be reclaimed from then on.
+		 */
+		void
+		release()
 		{
 			kv_p.off = 0;
+			if (em) {
+				em->unhold(pin);
+				em = nullptr;
+			}
+		}
+	};
+
+	/* flushes and replaced items of a thread */
+	struct alignas(cache_line_bytes) persist_group : cache_aligned {
+		std::vector<uint64_t> retired;
+		size_t depth;
+		bool pending;
+		/* the thread runs callbacks of parallel_scan() */
+		bool scanning;
+	};
+
+	/**
+	 * Groups the persistence of the operations a thread runs while the
+	 * guard lives
+	 *
+	 * Operations only flush the slots they publish and keep the items
+	 * they replace, and one fence when the outermost guard of the thread
+	 * goes away makes them durable and frees those items. Items are
+	 * still persisted before being published. Every operation opens a
+	 * group of its own, so a batch of operations under a guard fences
+	 * once instead of once per operation. Results are visible to other
+	 * threads at once, but only durable when the guard is gone.
+	 */
+	class persist_guard {
+		friend class NRHI<Key, T, Hash, KeyEqual, Geometry>;
+
+	public:
+		explicit persist_guard(NRHI &r_map)
+		    : map(r_map), g(map.rt->groups[thread_id::get()])
+		{
+			g.depth++;
+		}
+
+		persist_guard(const persist_guard &) = delete;
+		persist_guard &operator=(const persist_guard &) = delete;
+
+		~persist_guard()
+		{
+			if (--g.depth != 0)
+				return;
+			if (g.pending) {
+				map.get_pool_base().drain();
+				g.pending = false;
+			}
+			for (uint64_t sv : g.retired)
+				map.retire_kv(sv);
+			g.retired.clear();
+		}
+
+	private:
+		NRHI &map;
+		typename NRHI::persist_group &g;
+
+		/* flush a slot whose update completes an operation */
+		void
+		flush(pool_base &pop, const void *addr, size_t len)
+		{
+			pop.flush(addr, len);
+			g.pending = true;
+		}
+
+		/* retire an item once the slot that held it is durable */
+		void
+		retire(uint64_t sv)
+		{
+			g.retired.push_back(sv);
 		}
 	};
 
@@ -182,9 +425,19 @@ public:
 		}
 	};
 
-	struct ALIGNED(CACHE_LINE_SIZE) bucket {
+	struct alignas(Geometry::alignment) bucket {
 		kv_ptr_u slots[slots_num];
+
+		probe_mask
+		probe(partial_t token) const
+		{
+			return probe_slots<slots_num>(
+				reinterpret_cast<const uint64_t *>(slots),
+				token);
+		}
 	};
+	static_assert(sizeof(kv_ptr_u) == sizeof(uint64_t),
+		      "probe_slots expects 64bit slots");
 	// compound_pool_ptr has only one public 64bit `off` to update
 	using buckets_ptr_t = detail::compound_pool_ptr<bucket[]>;
 
@@ -205,6 +458,242 @@ public:
 		directory_ptr_t next;
 	};
 
+	/*
+	 * Volatile Bloom filter of a segment: one word per bucket, every
+	 * item sets filter_hashes bits of the word of its bucket. Bits are
+	 * never cleared on erase, so stale positives are tolerated.
+	 */
+	using filter_word = std::atomic<uint64_t>;
+	static const size_type filter_hashes = 3;
+	/*
+	 * Low bit of the filter pointer of a segment from recover() until
+	 * the filter is refilled. Writers add to such a filter, lookups do
+	 * not trust it.
+	 */
+	static const uintptr_t filter_partial = 1;
+	/* set with filter_partial by the thread refilling the filter */
+	static const uintptr_t filter_scanning = 2;
+
+	/* DRAM descriptor of a layer, holds absolute addresses only */
+	struct layer_desc {
+		directory *dir;
+		segment *segments;
+		size_type segs_power;
+		/* per-segment filters, allocated on first insert */
+		std::atomic<filter_word *> *filters;
+		/* per-segment item counts, a hint for shrink() */
+		std::atomic<int64_t> *occupancy;
+	};
+
+	/*
+	 * Immutable snapshot of all layers, root first. A new snapshot is
+	 * published atomically on expansion, so readers never see a layer
+	 * half-registered and never chase directory pointers in PM.
+	 */
+	struct layer_registry {
+		size_type num;
+		/* bottom layers being drained, never chosen by inserts */
+		size_type drain;
+		/* the top layer is about to be unlinked by shrink() */
+		bool seal_top;
+		layer_desc layers[max_layers];
+	};
+
+	/* a block read from a snapshot, all of its records in one partition */
+	struct import_block {
+		std::vector<char> data;
+		uint64_t records;
+		uint64_t partition;
+		std::vector<value_type> items;
+		std::vector<hashcode_t> hs;
+	};
+
+	/* blocks read from a snapshot, then their items with hash codes */
+	struct import_batch {
+		std::vector<import_block> blocks;
+		std::vector<value_type> items;
+		std::vector<hashcode_t> hs;
+	};
+
+	/* a segment of a registered layer */
+	struct segment_ref {
+		const layer_desc *ld;
+		ptrdiff_t idx;
+	};
+
+	/*
+	 * Move of the migrator in flight, the destination slot is set to val
+	 * before the source slot is cleared. Resolved by recover().
+	 */
+	struct move_log {
+		/* pool offset of the source slot, 0 if no move is in flight */
+		p<uint64_t> src;
+		/* pool offset of the destination slot */
+		p<uint64_t> dst;
+		/* header the destination slot is set to */
+		p<uint64_t> val;
+	};
+
+	/*
+	 * Bucket array unlinked by shrink() and freed after a grace period.
+	 * Freed again by recover() if the pool was closed in between.
+	 */
+	struct reclaim_log {
+		/* pool offset of the segment the array belonged to */
+		p<uint64_t> seg;
+		persistent_ptr<bucket[]> buckets;
+	};
+
+	/*
+	 * Objects reachable from the table while recover() looks for leaks,
+	 * one bit per reach_unit bytes of the pool. Objects sharing a unit
+	 * are all taken as reachable, which may keep a leak but never frees
+	 * a live object.
+	 */
+	struct reach_map {
+		explicit reach_map(uint64_t extent)
+		    : words(extent / reach_unit / 64 + 1),
+		      bits(new std::atomic<uint64_t>[words]())
+		{
+		}
+
+		/* thread safe */
+		void
+		mark(uint64_t off)
+		{
+			uint64_t u = off / reach_unit;
+			if (u / 64 < words)
+				bits[u / 64].fetch_or(
+					1ULL << (u % 64),
+					std::memory_order_relaxed);
+		}
+
+		bool
+		marked(uint64_t off) const
+		{
+			uint64_t u = off / reach_unit;
+			return u / 64 < words &&
+				(bits[u / 64].load(std::memory_order_relaxed) &
+				 (1ULL << (u % 64)));
+		}
+
+		uint64_t words;
+		std::unique_ptr<std::atomic<uint64_t>[]> bits;
+	};
+
+	/* changes of the counts made by a thread */
+	struct alignas(cache_line_bytes) thread_counters : cache_aligned {
+		std::atomic<int64_t> items;
+		std::atomic<int64_t> segments;
+		/* see false_matches() */
+		std::atomic<uint64_t> false_matches;
+	};
+
+	/* item count saved by persist_size() */
+	struct size_checkpoint {
+		p<uint64_t> items;
+		/* 0 once the table is modified after the count was saved */
+		p<uint64_t> valid;
+	};
+
+	/*
+	 * DRAM state of an open table. The persistent image only keeps a
+	 * pointer to it, so nothing left over from a previous mapping of the
+	 * pool is ever read.
+	 */
+	struct runtime : cache_aligned {
+		runtime(pool_base r_pop, PMEMoid *slab_head)
+		    : pop(r_pop),
+		      layers(nullptr),
+		      groups(new persist_group[epoch_max_threads]()),
+		      migrator(nullptr),
+		      migrator_stop(false),
+		      migrate_cursor(0),
+		      moves_seq(0),
+		      shrink_pending(false),
+		      reserved_entries(0),
+		      kv_slabs(slab_kv ? new slab_allocator<value_type>(
+						 r_pop, slab_head)
+				       : nullptr),
+		      bucket_flags(0),
+		      refiller(nullptr),
+		      refiller_stop(false),
+		      rebuilder(nullptr),
+		      counters(new thread_counters[epoch_max_threads]()),
+		      base_items(0),
+		      base_segments(0),
+		      size_saved(false),
+		      recount_items(false),
+		      hash_samples(0),
+		      hash_or(0),
+		      hash_and(~0ULL)
+		{
+		}
+
+		/* handle of the pool the table lives in */
+		pool_base pop;
+
+		/* registry of layers, see build_layers() */
+		std::atomic<layer_registry *> layers;
+		/* serializes the writers of the registry */
+		std::mutex layers_lock;
+
+		/* epochs guarding memory unlinked from the table */
+		epoch_manager epochs;
+		/* persistence groups indexed by thread_id */
+		std::unique_ptr<persist_group[]> groups;
+
+		/* background migrator, see start_migrator() */
+		std::thread *migrator;
+		std::atomic<bool> migrator_stop;
+		std::mutex migrate_lock;
+		/* next bucket of the draining root layer */
+		size_type migrate_cursor;
+		/* odd while a move is in flight, bumped twice per move */
+		std::atomic<uint64_t> moves_seq;
+
+		/* some segment may have become empty since the last shrink() */
+		std::atomic<bool> shrink_pending;
+		/* entries shrink() leaves room for, see reserve() */
+		std::atomic<uint64_t> reserved_entries;
+
+		/* records of slab_kv items */
+		std::unique_ptr<slab_allocator<value_type>> kv_slabs;
+		/* allocation flags of bucket arrays, see bucket_class() */
+		uint64_t bucket_flags;
+
+		/* background refiller of the reservoir, see start_refiller() */
+		std::thread *refiller;
+		std::atomic<bool> refiller_stop;
+		std::mutex refill_lock;
+		std::condition_variable refill_cv;
+
+		/* background rebuild of the filters, see recover() */
+		std::thread *rebuilder;
+
+		/* changes of the counts indexed by thread_id, see size() */
+		std::unique_ptr<thread_counters[]> counters;
+		/* counts the changes apply to */
+		std::atomic<int64_t> base_items;
+		std::atomic<int64_t> base_segments;
+		/* saved_size is valid and must be cleared before a change */
+		std::atomic<bool> size_saved;
+		std::mutex size_lock;
+		/* recover() adds the items it finds to base_items */
+		bool recount_items;
+
+		/* hash codes inserted so far, see check_hash() */
+		std::atomic<size_t> hash_samples;
+		std::atomic<uint64_t> hash_or;
+		std::atomic<uint64_t> hash_and;
+	};
+
+	/* constructor arguments, see geometry_for() */
+	struct table_geometry {
+		size_type hashpower;
+		size_type segspower;
+	};
+
 	/* Explicit specialization of the converting constructor. */
 	explicit NRHI(size_type hashpower = 10, size_type segspower = 3)
 	{
@@ -212,8 +701,19 @@ public:
 
 		PMEMoid oid = pmemobj_oid(this);
 		assert(!OID_IS_NULL(oid));
+		layout.get_rw() = layout_word();
 		my_pool_uuid.get_rw() = oid.pool_uuid_lo;
 		bucket_size.get_rw() = 1UL << hashpower;
+		run_count.get_rw() = 0;
+		mlog.src.get_rw() = 0;
+		for (size_type k = 0; k < reclaim_batch; k++)
+			rlog[k].seg.get_rw() = 0;
+		for (size_type k = 0; k < reservoir_size; k++)
+			reservoir[k].off = 0;
+		slab_head = OID_NULL;
+		saved_size.items.get_rw() = 0;
+		saved_size.valid.get_rw() = 0;
+		init_volatile();
 
 		pool_base pop = get_pool_base();
 		transaction::run(pop, [&] {
@@ -228,7 +728,7 @@ public:
 
 			for (ptrdiff_t i = 0; i < (ptrdiff_t)(segs_num); i++) {
 				persistent_ptr<bucket[]> tmp_buckets =
-					make_persistent<bucket[]>(bucket_size);
+					alloc_buckets(pop, true);
 				tmp_dir->segments[i].buckets.off =
 					tmp_buckets.raw().off;
 				pop.persist(&(tmp_dir->segments[i].buckets.off),
@@ -238,7 +738,9 @@ public:
 			root_dir.off = tmp_dir.raw().off;
 			top_dir.off = tmp_dir.raw().off;
 		});
-		dirs.push_back(root_dir.get_address(my_pool_uuid));
+		build_layers();
+		rt->base_segments.store(linked_segments(),
+					std::memory_order_relaxed);
 	}
 
 	NRHI &operator=(const NRHI &table) = delete;
@@ -246,18 +748,159 @@ public:
 
 	~NRHI()
 	{
+		close();
 		std::cout << "nrhi destroy!" << std::endl;
 	}
 
+	/**
+	 * Get the geometry of a table whose root layer holds expected_items
+	 * at target_load_factor. Segments grow up to 2^max_hashpower buckets,
+	 * then their number grows instead.
+	 */
+	static table_geometry
+	geometry_for(size_type expected_items, double target_load_factor = 0.75)
+	{
+		assert(target_load_factor > 0 && target_load_factor <= 1);
+		double buckets =
+			expected_items / target_load_factor / entries_num;
+		size_type power = 2;
+		while (power < hashcode_size / 2 &&
+		       (double)(1UL << power) < buckets)
+			power++;
+
+		/* the segment index takes at least one bit of the hashcode */
+		table_geometry g;
+		g.segspower =
+			power > max_hashpower + 1 ? power - max_hashpower : 1;
+		g.hashpower = power - g.segspower;
+		return g;
+	}
+
+	/**
+	 * Rebuild the volatile state after the pool is reopened
+	 *
+	 * The DRAM state of the table is garbage once the pool is mapped
+	 * again, so it is created anew without being read. The table can be
+	 * used as soon as the layers are registered; the filters and
+	 * occupancy counts are refilled by a background thread meanwhile,
+	 * and lookups probe segments whose filter is not refilled yet. See
+	 * wait_recovered(). Tables of slab_kv items are scanned before
+	 * returning, since the free records of the slabs are not known
+	 * until then.
+	 *
+	 * Bucket arrays a thread allocated or took from the reservoir but
+	 * did not link before the crash are freed in any case, whatever
+	 * their allocation class.
+	 *
+	 * If nthreads is not 0, the segments are scanned by nthreads threads
+	 * before returning and the other objects of the table a crash left
+	 * unreachable are freed: items allocated but not linked yet, and the
+	 * directory and segments of a layer expand() did not link. The pool
+	 * must hold no other table of this type, nor value_type objects
+	 * allocated outside of the table.
+	 *
+	 * The DRAM state is freed by close(), which must be called before
+	 * the pool is closed.
+	 *
+	 * @throw std::runtime_error if the table was written with another
+	 * layout: another revision of the encoding of its entries, another
+	 * hasher or another bucket geometry. The table is left untouched.
+	 */
 	void
-	recover()
+	recover(size_type nthreads = 0)
 	{
-		directory_ptr_t dp = root_dir;
-		while (dp != nullptr) {
-			directory *layer = dp.get_address(my_pool_uuid);
-			top_dir = dp;
-			dp = layer->next;
+		if (layout.get_ro() != layout_word()) {
+			rt = nullptr;
+			throw std::runtime_error(
+				"table written with another layout");
+		}
+		init_volatile();
+		pool_base pop = get_pool_base();
+		/* inline entries claimed before the crash become reclaimable */
+		run_count.get_rw() = run_count.get_ro() + 1;
+		pop.persist(run_count);
+		resolve_move(pop);
+		resolve_reclaim(pop);
+
+		build_layers();
+		resolve_pending(pop);
+		rt->base_segments.store(linked_segments(),
+					std::memory_order_relaxed);
+		if (saved_size.valid.get_ro() != 0) {
+			rt->base_items.store(
+				(int64_t)saved_size.items.get_ro(),
+				std::memory_order_relaxed);
+			rt->size_saved.store(true, std::memory_order_relaxed);
+		} else {
+			rt->recount_items = true;
+		}
+
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_relaxed);
+		for (size_type l = 0; l < ls->num; l++) {
+			size_type segs_num = 1UL << ls->layers[l].segs_power;
+			for (size_type s = 0; s < segs_num; s++)
+				ls->layers[l].filters[s].store(
+					filter_tag(nullptr),
+					std::memory_order_relaxed);
 		}
+
+		if (nthreads == 0 && !slab_kv) {
+			rt->rebuilder = new std::thread([this, pop]() mutable {
+				std::lock_guard<std::mutex> lock(
+					rt->migrate_lock);
+				rebuild_layer_state(pop, 1, nullptr);
+			});
+			return;
+		}
+		if (slab_kv)
+			rt->kv_slabs->begin_recovery();
+		if (nthreads == 0) {
+			rebuild_layer_state(pop, 1, nullptr);
+		} else {
+			reach_map reach(table_objects_extent(pop));
+			rebuild_layer_state(pop, nthreads, &reach);
+			free_unreachable(pop, reach, nthreads);
+		}
+		if (slab_kv)
+			rt->kv_slabs->end_recovery();
+	}
+
+	/**
+	 * Wait until the filters recover() refills in the background are
+	 * complete. Must be called before the pool is closed.
+	 */
+	void
+	wait_recovered()
+	{
+		if (rt->rebuilder == nullptr)
+			return;
+		rt->rebuilder->join();
+		delete rt->rebuilder;
+		rt->rebuilder = nullptr;
+	}
+
+	/**
+	 * Stop the background threads of the table, free the items retired
+	 * by its operations and drop its DRAM state. Must be called before
+	 * the pool is closed, with no operation running. The table can be
+	 * used again only after recover().
+	 */
+	void
+	close()
+	{
+		if (rt == nullptr)
+			return;
+		wait_recovered();
+		stop_migrator();
+		stop_refiller();
+		rt->epochs.reclaim_all();
+		layer_registry *ls = rt->layers.load(std::memory_order_relaxed);
+		for (size_type l = 0; l < ls->num; l++)
+			free_layer_state(ls->layers[l]);
+		delete ls;
+		delete rt;
+		rt = nullptr;
 	}
 
 	static void
@@ -290,13 +933,13 @@ public:
 	bool
 	find(const Key &key, accessor &res)
 	{
-		return generic_find(key, &res);
+		return generic_find(key, hasher{}(key), &res);
 	}
 
 	bool
 	find(const Key &key)
 	{
-		return generic_find(key, nullptr);
+		return generic_find(key, hasher{}(key), nullptr);
 	}
 
 	/**
@@ -316,7 +959,57 @@ public:
 	bool
 	find(const K &key, accessor &res)
 	{
-		return generic_find(key, &res);
+		return generic_find(key, hasher{}(key), &res);
+	}
+
+	/**
+	 * Find items with corresponding keys in one batch
+	 *
+	 * All keys are hashed first, then the bucket lines of every layer and
+	 * the candidate KV records are prefetched before any comparison, so
+	 * the PM misses of different keys overlap instead of being paid one
+	 * after another.
+	 *
+	 * @param[in] keys array of n keys to look up.
+	 * @param[out] res array of n accessors, res[i] is left empty if
+	 * keys[i] is not found.
+	 * @return number of items found.
+	 */
+	size_type
+	find_batch(const Key *keys, size_type n, accessor *res)
+	{
+		return generic_find_batch(keys, nullptr, n, res, nullptr);
+	}
+
+	/**
+	 * Find items with corresponding keys in one batch
+	 *
+	 * @param[in] keys array of n keys to look up.
+	 * @param[out] found array of n flags, found[i] is true iff keys[i]
+	 * is found.
+	 * @return number of items found.
+	 */
+	size_type
+	find_batch(const Key *keys, size_type n, bool *found)
+	{
+		return generic_find_batch(keys, nullptr, n, nullptr, found);
+	}
+
+	/**
+	 * Find items with corresponding keys in one batch
+	 *
+	 * This overload only participates in overload resolution if the
+	 * qualified-id Hash::transparent_key_equal is valid and denotes a type.
+	 *
+	 * @return number of items found.
+	 */
+	template <typename K,
+		  typename = typename std::enable_if<
+			  has_transparent_key_equal<hasher>::value, K>::type>
+	size_type
+	find_batch(const K *keys, size_type n, accessor *res)
+	{
+		return generic_find_batch(keys, nullptr, n, res, nullptr);
 	}
 
 	/**
@@ -327,29 +1020,74 @@ public:
 	bool
 	insert(const value_type &value)
 	{
-		return generic_insert(value.first, &value,
-				      allocate_kv_copy_construct, nullptr);
+		return generic_insert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
 	}
 
 	bool
 	insert(const value_type &value, accessor &res)
 	{
-		return generic_insert(value.first, &value,
-				      allocate_kv_copy_construct, &res);
+		return generic_insert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct, &res);
 	}
 
 	bool
 	insert(value_type &&value)
 	{
-		return generic_insert(value.first, &value,
-				      allocate_kv_move_construct, nullptr);
+		return generic_insert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
 	}
 
 	bool
 	insert(value_type &&value, accessor &res)
 	{
-		return generic_insert(value.first, &value,
-				      allocate_kv_move_construct, &res);
+		return generic_insert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	/**
+	 * Insert the items of [first, last) with nthreads threads
+	 *
+	 * Segments and layers for all items are allocated up front. Items
+	 * are then split by bucket index, which is the same in every layer,
+	 * so each thread owns its buckets in all layers. A thread fills the
+	 * buckets one after another and flushes every bucket line it wrote
+	 * once, with a single drain at the end. Items whose buckets are full
+	 * in every layer are inserted one by one, reusing their hash codes.
+	 *
+	 * Other operations may run meanwhile, but keys of the range must not
+	 * be inserted by them. The migrator is paused until the load is done.
+	 *
+	 * @return number of items inserted, keys already present are skipped.
+	 * @throw std::bad_alloc on allocation failure.
+	 */
+	template <typename RandomIt>
+	size_type
+	bulk_load(RandomIt first, RandomIt last, size_type nthreads = 1)
+	{
+		static_assert(
+			std::is_same<typename std::iterator_traits<
+					     RandomIt>::iterator_category,
+				     std::random_access_iterator_tag>::value,
+			"bulk_load expects random access iterators");
+		assert(nthreads > 0);
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		drop_saved_size();
+		size_type n = (size_type)(last - first);
+		if (n == 0)
+			return 0;
+
+		std::vector<hashcode_t> hs(n);
+		parallel_run(nthreads, [&](size_type t) {
+			for (size_type i = t; i < n; i += nthreads)
+				hs[i] = hasher{}(
+					as_item(first[(ptrdiff_t)i]).first);
+		});
+		for (size_type i = 0; i < n && i < hash_check_samples; i++)
+			check_hash(hs[i]);
+		return bulk_insert(first, hs.data(), n, nthreads);
 	}
 
 	/**
@@ -361,30 +1099,117 @@ public:
 	bool
 	update(const value_type &value)
 	{
-		return generic_update(value.first, &value,
-				      allocate_kv_copy_construct, nullptr);
+		return generic_update(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
 	}
 
 	bool
 	update(const value_type &value, accessor &res)
 	{
-		return generic_update(value.first, &value,
-				      allocate_kv_copy_construct, &res);
+		return generic_update(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct, &res);
 	}
 
 	bool
 	update(value_type &&value)
 	{
-		return generic_update(value.first, &value,
-				      allocate_kv_move_construct, nullptr);
+		return generic_update(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
 	}
 
 	bool
 	update(value_type &&value, accessor &res)
 	{
-		return generic_update(value.first, &value,
-				      allocate_kv_move_construct, &res);
+		return generic_update(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	/**
+	 * Insert item, or replace the item with the same key if present.
+	 *
+	 * Unlike insert() followed by update(), the layers are walked once:
+	 * the walk finds both the entry of the key and the slot an insert
+	 * would take, and a single CAS then either replaces the entry or
+	 * fills the slot.
+	 *
+	 * @return true if item is new, false if an item was replaced.
+	 * @throw std::bad_alloc on allocation failure.
+	 * @throw std::runtime_error if the table cannot grow for the item.
+	 */
+	bool
+	insert_or_assign(const value_type &value)
+	{
+		return generic_upsert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_or_assign(const value_type &value, accessor &res)
+	{
+		return generic_upsert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_copy_construct, &res);
+	}
+
+	bool
+	insert_or_assign(value_type &&value)
+	{
+		return generic_upsert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_or_assign(value_type &&value, accessor &res)
+	{
+		return generic_upsert(value.first, hasher{}(value.first),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	/**
+	 * Replace the value of key without allocating a new item where it
+	 * can be written in place, see generic_rmw().
+	 * @return false if key is not present.
+	 * @throw std::bad_alloc if a copy of the item cannot be allocated.
+	 */
+	bool
+	store(const key_type &key, const T &value)
+	{
+		return generic_store(key, hasher{}(key), value);
+	}
+
+	/**
+	 * Add delta to the integer value of key as one atomic operation,
+	 * see generic_rmw().
+	 * @param previous receives the value before the addition.
+	 * @return false if key is not present.
+	 */
+	template <typename U = T>
+	bool
+	fetch_add(const key_type &key, typename counter_of<U>::type delta,
+		  typename counter_of<U>::type *previous = nullptr)
+	{
+		return generic_fetch_add<U>(key, hasher{}(key), delta,
+					    previous);
+	}
+
+	/**
+	 * Replace the value of key with desired if its bytes equal those of
+	 * expected, otherwise load it into expected, as one atomic
+	 * operation, see generic_rmw().
+	 * @return true if the value was replaced, false if it differed or
+	 * key is not present, which leaves expected as it was.
+	 * @throw std::bad_alloc if a copy of the item cannot be allocated.
+	 */
+	bool
+	compare_exchange(const key_type &key, T &expected, const T &desired)
+	{
+		return generic_compare_exchange(key, hasher{}(key), expected,
+						desired);
 	}
+
 	/**
 	 * Remove item with corresponding key
 	 * @return true if item was deleted by this call.
@@ -393,7 +1218,7 @@ public:
 	bool
 	erase(const Key &key)
 	{
-		return generic_erase(key);
+		return generic_erase(key, hasher{}(key));
 	}
 
 	/**
@@ -414,56 +1239,413 @@ public:
 	bool
 	erase(const K &key)
 	{
-		return generic_erase(key);
+		return generic_erase(key, hasher{}(key));
 	}
 
-	/**
-	 * Get current capacity
-	 */
-	uint64_t
-	capacity()
+	//------------------------------------------------------------------------
+	// Operations on keys hashed by the caller
+	//
+	// The overloads below take the hash code h the caller computed with
+	// hasher for its own purposes, e.g. to route requests, and skip
+	// hashing the key again. Debug builds check h against hasher.
+	//------------------------------------------------------------------------
+
+	bool
+	find_hashed(const Key &key, hashcode_t h, accessor &res)
 	{
-		std::unordered_map<bucket *, bool> umap;
-		directory_ptr_t dp = root_dir;
-		uint64_t effective_segs_num = 0;
-		while (dp != nullptr) {
-			directory *layer = dp.get_address(my_pool_uuid);
-			size_type segs_num = 1UL << layer->segs_power.get_ro();
+		return generic_find(key, checked_hash(key, h), &res);
+	}
 
-			for (ptrdiff_t i = 0; i < (ptrdiff_t)(segs_num); i++) {
-				segment &seg = layer->segments[i];
-				if (seg.buckets.off != 0) {
-					umap[seg.buckets.get_address(
-						my_pool_uuid)] = true;
-					effective_segs_num++;
-				}
-			}
-			dp = layer->next;
-		}
+	bool
+	find_hashed(const Key &key, hashcode_t h)
+	{
+		return generic_find(key, checked_hash(key, h), nullptr);
+	}
 
-		uint64_t cap = effective_segs_num * bucket_size * slots_num;
+	template <typename K,
+		  typename = typename std::enable_if<
+			  has_transparent_key_equal<hasher>::value, K>::type>
+	bool
+	find_hashed(const K &key, hashcode_t h, accessor &res)
+	{
+		return generic_find(key, checked_hash(key, h), &res);
+	}
+
+	/**
+	 * Find items with corresponding keys in one batch, see
+	 * find_batch(). hashes[i] is the hash code of keys[i].
+	 * @return number of items found.
+	 */
+	size_type
+	find_batch_hashed(const Key *keys, const hashcode_t *hashes,
+			  size_type n, accessor *res)
+	{
+		return generic_find_batch(keys, checked_hashes(keys, hashes, n),
+					  n, res, nullptr);
+	}
+
+	size_type
+	find_batch_hashed(const Key *keys, const hashcode_t *hashes,
+			  size_type n, bool *found)
+	{
+		return generic_find_batch(keys, checked_hashes(keys, hashes, n),
+					  n, nullptr, found);
+	}
+
+	bool
+	insert_hashed(const value_type &value, hashcode_t h)
+	{
+		return generic_insert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_hashed(const value_type &value, hashcode_t h, accessor &res)
+	{
+		return generic_insert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct, &res);
+	}
+
+	bool
+	insert_hashed(value_type &&value, hashcode_t h)
+	{
+		return generic_insert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_hashed(value_type &&value, hashcode_t h, accessor &res)
+	{
+		return generic_insert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	bool
+	update_hashed(const value_type &value, hashcode_t h)
+	{
+		return generic_update(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
+	}
+
+	bool
+	update_hashed(const value_type &value, hashcode_t h, accessor &res)
+	{
+		return generic_update(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct, &res);
+	}
+
+	bool
+	update_hashed(value_type &&value, hashcode_t h)
+	{
+		return generic_update(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
+	}
+
+	bool
+	update_hashed(value_type &&value, hashcode_t h, accessor &res)
+	{
+		return generic_update(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	bool
+	insert_or_assign_hashed(const value_type &value, hashcode_t h)
+	{
+		return generic_upsert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_or_assign_hashed(const value_type &value, hashcode_t h,
+				accessor &res)
+	{
+		return generic_upsert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_copy_construct, &res);
+	}
+
+	bool
+	insert_or_assign_hashed(value_type &&value, hashcode_t h)
+	{
+		return generic_upsert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct,
+				      nullptr);
+	}
+
+	bool
+	insert_or_assign_hashed(value_type &&value, hashcode_t h,
+				accessor &res)
+	{
+		return generic_upsert(value.first, checked_hash(value.first, h),
+				      &value, allocate_kv_move_construct, &res);
+	}
+
+	bool
+	store_hashed(const key_type &key, hashcode_t h, const T &value)
+	{
+		return generic_store(key, checked_hash(key, h), value);
+	}
+
+	template <typename U = T>
+	bool
+	fetch_add_hashed(const key_type &key, hashcode_t h,
+			 typename counter_of<U>::type delta,
+			 typename counter_of<U>::type *previous = nullptr)
+	{
+		return generic_fetch_add<U>(key, checked_hash(key, h), delta,
+					    previous);
+	}
+
+	bool
+	compare_exchange_hashed(const key_type &key, hashcode_t h,
+				T &expected, const T &desired)
+	{
+		return generic_compare_exchange(key, checked_hash(key, h),
+						expected, desired);
+	}
+
+	bool
+	erase_hashed(const Key &key, hashcode_t h)
+	{
+		return generic_erase(key, checked_hash(key, h));
+	}
+
+	template <typename K,
+		  typename = typename std::enable_if<
+			  has_transparent_key_equal<hasher>::value, K>::type>
+	bool
+	erase_hashed(const K &key, hashcode_t h)
+	{
+		return generic_erase(key, checked_hash(key, h));
+	}
+
+	/**
+	 * Call fn(item) with a const reference to every item of the table.
+	 * See parallel_for_each() for the guarantees under concurrent
+	 * operations.
+	 */
+	template <typename F>
+	void
+	for_each(F fn)
+	{
+		parallel_for_each(fn, 1);
+	}
+
+	/**
+	 * Call fn(item) with a const reference to every item of the table
+	 * from nthreads threads, each taking the next segment of any layer
+	 * that is not scanned yet, so fn must be thread safe.
+	 *
+	 * Moves of the migrator, consolidate() and shrink() wait for the scan
+	 * to end, so no item is visited twice. Other operations may run
+	 * meanwhile: an item present for the whole scan is visited exactly
+	 * once, an item inserted or erased during the scan may be visited or
+	 * not, and items in layers added by the scan's inserts are not. An
+	 * item is only valid while fn runs on it.
+	 *
+	 * fn may run lookups and modifications, but not bulk_load(),
+	 * reserve(), consolidate(), shrink(), import_snapshot(),
+	 * export_snapshot() or another scan, which wait for the scan to end.
+	 * @throw the first exception thrown by fn, the scan stops then.
+	 * @throw std::logic_error if fn calls one of the above.
+	 */
+	template <typename F>
+	void
+	parallel_for_each(F fn, size_type nthreads)
+	{
+		parallel_scan([&](size_type, const value_type &v) { fn(v); },
+			      nthreads);
+	}
+
+	/**
+	 * Write every item with the hash code of its key to a snapshot,
+	 * walking the table as parallel_for_each() does with nthreads
+	 * threads. Records are grouped into blocks by the top partition_bits
+	 * bits of their hash codes. Keys and values are encoded by
+	 * snapshot_codec.
+	 * @return number of items written.
+	 * @throw std::runtime_error if the stream fails.
+	 * @throw std::length_error if an item encodes to more than
+	 * snapshot_max_record_bytes.
+	 */
+	uint64_t
+	export_snapshot(std::ostream &os, size_type nthreads = 1,
+			size_type partition_bits = 4)
+	{
+		assert(nthreads > 0);
+		snapshot_writer w(os, partition_bits);
+		std::vector<std::unique_ptr<snapshot_writer::buffer>> bufs;
+		for (size_type t = 0; t < nthreads; t++)
+			bufs.emplace_back(new snapshot_writer::buffer(w));
+		parallel_scan(
+			[&](size_type t, const value_type &v) {
+				bufs[t]->add(hasher{}(v.first), v.first,
+					     v.second);
+			},
+			nthreads);
+		for (auto &b : bufs)
+			b->flush();
+		return w.finish();
+	}
+
+	/**
+	 * Insert the items of a snapshot with nthreads threads, as
+	 * bulk_load() does, taking the hash codes from the snapshot instead
+	 * of hashing the keys. Blocks are read in batches of
+	 * import_batch_bytes, the next batch being read while the current
+	 * one is decoded and inserted. The threads decode whole blocks, so
+	 * each decodes records of one partition at a time.
+	 *
+	 * Every record must fall in the partition of its block, and the
+	 * first record of every block is hashed again as a check that the
+	 * snapshot was written with the hasher of the table.
+	 *
+	 * @return number of items inserted, keys already present are skipped.
+	 * @throw std::runtime_error if the snapshot is corrupt or its hash
+	 * codes do not match the hasher of the table.
+	 * @throw std::bad_alloc on allocation failure.
+	 */
+	size_type
+	import_snapshot(std::istream &is, size_type nthreads = 1)
+	{
+		assert(nthreads > 0);
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		drop_saved_size();
+		snapshot_reader r(is);
+		import_batch cur, next;
+		bool more = read_batch(r, cur);
+		size_type inserted = 0;
+		while (!cur.blocks.empty()) {
+			std::exception_ptr error;
+			std::thread reader([&] {
+				try {
+					more = more && read_batch(r, next);
+				} catch (...) {
+					error = std::current_exception();
+				}
+			});
+			try {
+				decode_batch(r, cur, nthreads);
+				inserted += bulk_insert(cur.items.begin(),
+							cur.hs.data(),
+							cur.items.size(),
+							nthreads);
+			} catch (...) {
+				reader.join();
+				throw;
+			}
+			reader.join();
+			if (error)
+				std::rethrow_exception(error);
+			std::swap(cur, next);
+			next.blocks.clear();
+			next.items.clear();
+			next.hs.clear();
+		}
+		return inserted;
+	}
+
+	/**
+	 * Allocate segments and layers until expected_items fit at
+	 * target_load_factor, so that inserts of a known ingest window do not
+	 * allocate PM, and keep shrink() from freeing that room again.
+	 * reserve(0) drops the reservation. Other operations may run
+	 * meanwhile.
+	 * @throw std::bad_alloc on allocation failure.
+	 */
+	void
+	reserve(size_type expected_items, double target_load_factor = 0.75,
+		size_type nthreads = 1)
+	{
+		assert(target_load_factor > 0 && target_load_factor <= 1);
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		uint64_t entries =
+			(uint64_t)(expected_items / target_load_factor);
+		rt->reserved_entries.store(entries, std::memory_order_relaxed);
+		pool_base pop = get_pool_base();
+		grow(pop, entries, nthreads);
+	}
+
+	/**
+	 * Get the number of items, summed over the counters of the threads.
+	 * Only approximate while recover() is refilling the counts, or while
+	 * operations run.
+	 */
+	uint64_t
+	size() const
+	{
+		int64_t items = rt->base_items.load(std::memory_order_relaxed);
+		size_type n = thread_id::limit();
+		for (size_type t = 0; t < n; t++)
+			items += rt->counters[t].items.load(
+				std::memory_order_relaxed);
+		return items > 0 ? (uint64_t)items : 0;
+	}
+
+	/**
+	 * Get the number of key comparisons made so far for tokens matching
+	 * the token of another key, each costing a read of PM for nothing.
+	 */
+	uint64_t
+	false_matches() const
+	{
+		uint64_t n = 0;
+		size_type threads = thread_id::limit();
+		for (size_type t = 0; t < threads; t++)
+			n += rt->counters[t].false_matches.load(
+				std::memory_order_relaxed);
+		return n;
+	}
+
+	/**
+	 * Get current capacity
+	 */
+	uint64_t
+	capacity() const
+	{
+		int64_t segs =
+			rt->base_segments.load(std::memory_order_relaxed);
+		size_type n = thread_id::limit();
+		for (size_type t = 0; t < n; t++)
+			segs += rt->counters[t].segments.load(
+				std::memory_order_relaxed);
+		uint64_t cap = (uint64_t)segs * bucket_size * entries_num;
 
 #ifdef DEBUG_CAPACITY
+		epoch_manager::guard guard(rt->epochs);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
 		uint64_t items = 0;
-		for (auto it = umap.begin(); it != umap.end(); it++) {
-			int sc = 0;
-			for (size_type j = 0; j < bucket_size; j++) {
-				bucket &b = it->first[j];
-				int c = 0;
-				for (size_type m = 0; m < slots_num; m++) {
-					if (b.slots[m].p.get_offset() != 0 &&
-					    b.slots[m].token != 0) {
-						items++;
-						c++;
+		for (size_type l = 0; l < ls->num; l++) {
+			const layer_desc &ld = ls->layers[l];
+			for (size_type i = 0; i < (1UL << ld.segs_power); i++) {
+				segment &seg = ld.segments[i];
+				if (seg.buckets.get_offset() == 0)
+					continue;
+				bucket *bs = seg.buckets.get_address(
+					my_pool_uuid);
+				int sc = 0;
+				for (size_type j = 0; j < bucket_size; j++) {
+					int c = 0;
+					for (size_type m = 0; m < slots_num;
+					     m += entry_slots) {
+						if (load_slot(bs[j], m) != 0) {
+							items++;
+							c++;
+						}
 					}
+					std::cout << "bucket " << j
+						  << " cap: " << c << std::endl;
+					sc += c;
 				}
-				std::cout << "bucket " << j << " cap: " << c
+				std::cout << "segment: " << bs << " cap: " << sc
+					  << std::endl
 					  << std::endl;
-				sc += c;
 			}
-			std::cout << "segment: " << (it->first)
-				  << " cap: " << sc << std::endl
-				  << std::endl;
 		}
 
 		std::cout << "items:" << items << "\tcap:" << cap << '\t'
@@ -473,35 +1655,262 @@ public:
 		return cap;
 	}
 
+	/**
+	 * Get the ratio of items to capacity.
+	 */
+	double
+	load_factor() const
+	{
+		uint64_t cap = capacity();
+		return cap != 0 ? (double)size() / cap : 0;
+	}
+
+	/**
+	 * Save the number of items in the pool, so that the next recover()
+	 * need not count them. The count stays valid until the table is
+	 * modified again. Must not run concurrently with modifications,
+	 * typically called right before the pool is closed.
+	 */
+	void
+	persist_size()
+	{
+		pool_base pop = get_pool_base();
+		saved_size.items.get_rw() = size();
+		pop.persist(saved_size.items);
+		saved_size.valid.get_rw() = 1;
+		pop.persist(saved_size.valid);
+		rt->size_saved.store(true, std::memory_order_release);
+	}
+
+	/**
+	 * Start a background thread consolidating layers
+	 *
+	 * Whenever a lookup may probe more than probe_limit layers, items
+	 * of the oldest layer are moved into the upper ones, at most
+	 * moves_per_ms per millisecond, and the layer is freed once empty.
+	 * Segments emptied by erasures are returned by the same thread.
+	 */
+	void
+	start_migrator(size_type probe_limit = 4, size_type moves_per_ms = 64)
+	{
+		assert(probe_limit > 0);
+		if (rt->migrator != nullptr)
+			return;
+		rt->migrator_stop.store(false, std::memory_order_relaxed);
+		rt->migrator = new std::thread([this, probe_limit,
+						moves_per_ms] {
+			while (!rt->migrator_stop.load(
+				std::memory_order_relaxed)) {
+				size_type moved =
+					consolidate(probe_limit, moves_per_ms);
+				if (rt->shrink_pending.load(
+					    std::memory_order_relaxed))
+					shrink();
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(moved ? 1
+									: 10));
+			}
+		});
+	}
+
+	void
+	stop_migrator()
+	{
+		if (rt->migrator == nullptr)
+			return;
+		rt->migrator_stop.store(true, std::memory_order_relaxed);
+		rt->migrator->join();
+		delete rt->migrator;
+		rt->migrator = nullptr;
+	}
+
+	/**
+	 * Start a background thread keeping reservoir_size zeroed bucket
+	 * arrays allocated, so that inserts allocating a segment only link
+	 * one of them.
+	 */
+	void
+	start_refiller()
+	{
+		if (rt->refiller != nullptr)
+			return;
+		rt->refiller_stop.store(false, std::memory_order_relaxed);
+		rt->refiller = new std::thread([this] {
+			pool_base pop = get_pool_base();
+			std::unique_lock<std::mutex> lock(rt->refill_lock);
+			while (!rt->refiller_stop.load(
+				std::memory_order_relaxed)) {
+				lock.unlock();
+				try {
+					reservoir_fill(pop);
+				} catch (std::bad_alloc &) {
+					/* retried once the pool has room */
+				}
+				lock.lock();
+				rt->refill_cv.wait_for(
+					lock, std::chrono::milliseconds(10));
+			}
+		});
+	}
+
+	void
+	stop_refiller()
+	{
+		if (rt->refiller == nullptr)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(rt->refill_lock);
+			rt->refiller_stop.store(true,
+						std::memory_order_relaxed);
+		}
+		rt->refill_cv.notify_one();
+		rt->refiller->join();
+		delete rt->refiller;
+		rt->refiller = nullptr;
+	}
+
+	/**
+	 * Move at most max_moves items out of the oldest layer if a lookup
+	 * may probe more than probe_limit layers, and unlink the layer once
+	 * it is empty. Runs concurrently with all other operations.
+	 * @return number of items moved.
+	 * @throw std::logic_error if the thread holds an accessor.
+	 */
+	size_type
+	consolidate(size_type probe_limit, size_type max_moves)
+	{
+		rt->epochs.check_unpinned();
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		pool_base pop = get_pool_base();
+		layer_registry ls;
+		copy_layers(ls);
+		if (ls.num <= probe_limit || ls.num < 2)
+			return 0;
+
+		if (ls.drain == 0) {
+			/* no insert may pick the root layer past this point */
+			publish_drain(1);
+			rt->epochs.synchronize();
+			copy_layers(ls);
+			rt->migrate_cursor = 0;
+		}
+
+		const layer_desc &root = ls.layers[0];
+		size_type buckets_num = (1UL << root.segs_power) * bucket_size;
+		size_type moved = 0;
+		while (moved < max_moves && rt->migrate_cursor < buckets_num) {
+			ptrdiff_t segment_idx =
+				(ptrdiff_t)(rt->migrate_cursor / bucket_size);
+			ptrdiff_t bucket_idx =
+				(ptrdiff_t)(rt->migrate_cursor % bucket_size);
+			segment &seg = root.segments[segment_idx];
+			rt->migrate_cursor++;
+			if (seg.buckets.get_offset() == 0)
+				continue;
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+			for (size_type i = 0; i < slots_num; i += entry_slots) {
+				if (move_entry(pop, root, segment_idx, b,
+					       b_off_of(seg, bucket_idx), i))
+					moved++;
+			}
+		}
+
+		if (rt->migrate_cursor == buckets_num) {
+			/* entries that could not move are retried next pass */
+			rt->migrate_cursor = 0;
+			if (layer_empty(root))
+				unlink_root(pop);
+		}
+		return moved;
+	}
+
+	/**
+	 * Free the bucket arrays of empty segments, then the top layer if no
+	 * segment is left in it. Runs concurrently with all other operations.
+	 * @return number of segments freed.
+	 * @throw std::logic_error if the thread holds an accessor.
+	 */
+	size_type
+	shrink()
+	{
+		rt->epochs.check_unpinned();
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		pool_base pop = get_pool_base();
+		rt->shrink_pending.store(false, std::memory_order_relaxed);
+		layer_registry ls;
+		copy_layers(ls);
+
+		std::vector<segment_ref> cands;
+		uint64_t seg_entries = bucket_size * entries_num;
+		uint64_t room = 0;
+		for (size_type l = 0; l < ls.num; l++) {
+			const layer_desc &ld = ls.layers[l];
+			size_type segs_num = 1UL << ld.segs_power;
+			for (size_type i = 0; i < segs_num; i++) {
+				if (ld.segments[i].buckets.get_offset() == 0)
+					continue;
+				room += seg_entries;
+				if (ld.occupancy[i].load(
+					    std::memory_order_relaxed) <= 0)
+					cands.push_back(
+						segment_ref{&ld, (ptrdiff_t)i});
+			}
+		}
+		/* keep the room asked for by reserve() */
+		uint64_t keep =
+			rt->reserved_entries.load(std::memory_order_relaxed);
+		uint64_t spare = room > keep ? (room - keep) / seg_entries : 0;
+		if (cands.size() > spare)
+			cands.resize(spare);
+
+		size_type freed = 0;
+		for (size_type c = 0; c < cands.size(); c += reclaim_batch) {
+			size_type n = cands.size() - c;
+			if (n > reclaim_batch)
+				n = reclaim_batch;
+			freed += reclaim_segments(pop, &cands[c], n);
+		}
+		while (retire_top(pop))
+			;
+		return freed;
+	}
+
 protected:
+	/**
+	 * Allocate segment segment_idx of the layer if is_null, otherwise
+	 * link a new layer on top of it.
+	 * @return true if the caller may retry its insertion.
+	 */
 	bool
-	expand(pool_base &pop, directory_ptr_t &dp, ptrdiff_t &segment_idx,
+	expand(pool_base &pop, directory *layer, ptrdiff_t segment_idx,
 	       bool is_null)
 	{
-		directory *layer = dp.get_address(my_pool_uuid);
 		if (likely(is_null)) { /* allocate a segment w/o resizing dir */
-		EXPAND_SEG:
 			segment &seg = layer->segments[segment_idx];
 			uint64_t tmp_off = seg.buckets.off;
 			if (unlikely(tmp_off != 0))
 				return true; /* expanded by other thread */
 
-			persistent_ptr<bucket[]> new_buckets;
-			make_persistent_atomic<bucket[]>(pop, new_buckets,
-							 bucket_size);
+			persistent_ptr<bucket[]> new_buckets(
+				PMEMoid{my_pool_uuid, reservoir_pop(pop)});
+			if (new_buckets == nullptr)
+				new_buckets = alloc_buckets(pop, false);
 
 			if (CAS(&(seg.buckets.off), tmp_off,
 				new_buckets.raw().off)) {
 				pop.persist(&(seg.buckets.off),
 					    sizeof(uint64_t));
+				settle_buckets(pop, true);
+				count_segments(1);
 #ifdef DEBUG
 				std::cout << "[SUCC] expand segment "
 					  << segment_idx << std::endl;
 #endif
 			} else {
 				/* failed means it was updated by others */
-				delete_persistent_atomic<bucket[]>(new_buckets,
-								   bucket_size);
+				uint64_t off = new_buckets.raw().off;
+				settle_buckets(pop, reservoir_push(pop, off));
 #ifdef DEBUG
 				std::cout << "[FAIL] expand segment "
 					  << segment_idx << std::endl;
@@ -514,67 +1923,2274 @@ protected:
 				1UL << (layer->segs_power.get_ro() + EXPO);
 			uint64_t tmp_off = layer->next.off;
 
-			if (unlikely(tmp_off != 0))
-				return true; /* expanded by other thread */
+			if (unlikely(tmp_off != 0)) {
+				/* expanded by other thread */
+				publish_layers();
+				return true;
+			}
 
+			/* fill the unlinked directory, then fence once */
 			persistent_ptr<directory> new_layer;
 			make_persistent_atomic<directory>(pop, new_layer);
+			make_persistent_atomic<segment[]>(
+				pop, new_layer->segments, segs_num);
 			new_layer->segs_power.get_rw() =
 				layer->segs_power.get_ro() + EXPO;
-			pop.persist(new_layer->segs_power);
 			new_layer->next = nullptr;
-			pop.persist(&(new_layer->next.off), sizeof(uint64_t));
-			new_layer->prev.off = dp.off;
-			pop.persist(&(new_layer->prev.off), sizeof(uint64_t));
-			make_persistent_atomic<segment[]>(
-				pop, new_layer->segments, segs_num);
-			pop.persist(new_layer->segments);
+			new_layer->prev.off = pmemobj_oid(layer).off;
+			pop.persist(new_layer.get(), sizeof(directory));
 
-			bool succ = false;
 			if (CAS(&(layer->next.off), tmp_off,
 				new_layer.raw().off)) {
 				pop.persist(&(layer->next.off),
 					    sizeof(uint64_t));
 				std::cout << "expand new layer with cap "
 					  << segs_num << std::endl;
-				succ = true;
 			} else {
 				delete_persistent_atomic<segment[]>(
 					new_layer->segments, segs_num);
 				delete_persistent_atomic<directory>(new_layer);
 
-				std::cout << "another thread is expanding"
-					  << std::endl;
-			}
-			dp = layer->next;
-			top_dir = dp;
-			layer = dp.get_address(my_pool_uuid);
-			if (succ)
-				dirs.push_back(layer);
-			goto EXPAND_SEG;
+				std::cout << "another thread is expanding"
+					  << std::endl;
+			}
+			publish_layers();
+			return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Allocate and persist the record of an out-of-line item, from a
+	 * slab if the item is trivially copyable.
+	 * @return pool offset of the record.
+	 */
+	uint64_t
+	make_kv(pool_base &pop, const void *param,
+		void (*allocate_kv)(pool_base &, persistent_ptr<value_type> &,
+				    const void *))
+	{
+		if (slab_kv) {
+			uint64_t off = rt->kv_slabs->allocate();
+			void *kv = pmemobj_direct(PMEMoid{my_pool_uuid, off});
+			std::memcpy(kv, param, sizeof(value_type));
+			pop.persist(kv, sizeof(value_type));
+			return off;
+		}
+		persistent_ptr<value_type> kv_ptr;
+		allocate_kv(pop, kv_ptr, param);
+		return kv_ptr.raw().off;
+	}
+
+	/**
+	 * Free the record a slot value points to once no operation or
+	 * accessor may still read it.
+	 */
+	void
+	retire_kv(uint64_t sv)
+	{
+		rt->epochs.retire(sv, free_retired_kv, this);
+	}
+
+	static void
+	free_retired_kv(void *map, uint64_t sv)
+	{
+		static_cast<NRHI *>(map)->free_kv(sv);
+	}
+
+	/**
+	 * Free a snapshot of the layers replaced under layers_lock once no
+	 * operation may still read it.
+	 */
+	void
+	retire_layers(layer_registry *ls)
+	{
+		rt->epochs.retire((uint64_t)reinterpret_cast<uintptr_t>(ls),
+				  free_retired_layers, nullptr);
+	}
+
+	static void
+	free_retired_layers(void *, uint64_t ls)
+	{
+		delete reinterpret_cast<layer_registry *>((uintptr_t)ls);
+	}
+
+	/**
+	 * Copy the registered layers for a pass that cannot pin them, since
+	 * it waits for readers or runs for long. The layers copied stay valid
+	 * while the caller holds migrate_lock.
+	 */
+	void
+	copy_layers(layer_registry &ls)
+	{
+		epoch_manager::guard guard(rt->epochs);
+		ls = *rt->layers.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Free the record a slot value points to.
+	 */
+	void
+	free_kv(uint64_t sv)
+	{
+		uint64_t off = kv_ptr_t(sv).get_offset();
+		if (slab_kv) {
+			rt->kv_slabs->deallocate(off);
+			return;
+		}
+		PMEMoid oid = {my_pool_uuid, off};
+		pmemobj_free(&oid);
+	}
+
+	/**
+	 * Take a zeroed bucket array out of the reservoir into the pending
+	 * slot of the thread, see settle_buckets(). The pending slot is set
+	 * durably before the reservoir slot is cleared, so a crash in
+	 * between leaves the array in both rather than in neither.
+	 * @return pool offset of the array, 0 if the reservoir is empty.
+	 */
+	uint64_t
+	reservoir_pop(pool_base &pop)
+	{
+		PMEMoid &pending = pending_oid();
+		assert(pending.off == 0);
+		for (size_type k = 0; k < reservoir_size; k++) {
+			uint64_t &r = reservoir[k].off;
+			uint64_t off = __atomic_load_n(&r, __ATOMIC_ACQUIRE);
+			if (off == 0)
+				continue;
+			pending.pool_uuid_lo = my_pool_uuid;
+			pending.off = off;
+			pop.persist(&pending, sizeof(PMEMoid));
+			if (!CAS(&r, off, 0)) {
+				pending.off = 0;
+				pop.persist(&pending.off, sizeof(uint64_t));
+				continue;
+			}
+			pop.persist(&r, sizeof(uint64_t));
+			rt->refill_cv.notify_one();
+			return off;
+		}
+		return 0;
+	}
+
+	/**
+	 * Put back a bucket array that was never linked.
+	 * @return false if the reservoir is full.
+	 */
+	bool
+	reservoir_push(pool_base &pop, uint64_t off)
+	{
+		for (size_type k = 0; k < reservoir_size; k++) {
+			uint64_t &r = reservoir[k].off;
+			if (__atomic_load_n(&r, __ATOMIC_ACQUIRE) != 0 ||
+			    !CAS(&r, 0, off))
+				continue;
+			pop.persist(&r, sizeof(uint64_t));
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Allocate a bucket array for every empty slot of the reservoir.
+	 */
+	void
+	reservoir_fill(pool_base &pop)
+	{
+		for (size_type k = 0; k < reservoir_size; k++) {
+			if (__atomic_load_n(&(reservoir[k].off),
+					    __ATOMIC_ACQUIRE) != 0)
+				continue;
+			uint64_t off = alloc_buckets(pop, false).raw().off;
+			settle_buckets(pop, reservoir_push(pop, off));
+		}
+	}
+
+	/**
+	 * Clear the pending slot of the thread once its bucket array is
+	 * linked, or free the array.
+	 */
+	void
+	settle_buckets(pool_base &pop, bool linked)
+	{
+		PMEMoid &pending = pending_oid();
+		if (linked) {
+			pending.off = 0;
+			pop.persist(&pending.off, sizeof(uint64_t));
+		} else {
+			/* clears the slot in the same failure atomic step */
+			pmemobj_free(&pending);
+		}
+	}
+
+	/**
+	 * Get the pending slot of the thread, which holds the bucket array
+	 * it allocated or took from the reservoir until it is linked.
+	 */
+	PMEMoid &
+	pending_oid()
+	{
+		return *pending_buckets[thread_id::get()].raw_ptr();
+	}
+
+	/**
+	 * Allocate a zeroed bucket array, in the running transaction if tx,
+	 * otherwise into the pending slot of the thread, which
+	 * settle_buckets() clears once the array is linked. A crash in
+	 * between leaves the array to recover(), which cannot find arrays
+	 * of the class of bucket_class() by walking the heap.
+	 * @throw std::bad_alloc on allocation failure.
+	 */
+	persistent_ptr<bucket[]>
+	alloc_buckets(pool_base &pop, bool tx)
+	{
+		if (rt->bucket_flags == 0 && tx)
+			return make_persistent<bucket[]>(bucket_size);
+
+		size_t bytes = bucket_size * sizeof(bucket);
+		uint64_t flags = rt->bucket_flags | POBJ_XALLOC_ZERO;
+		PMEMoid oid;
+		if (tx) {
+			oid = pmemobj_tx_xalloc(bytes, 0, flags);
+			if (OID_IS_NULL(oid))
+				throw std::bad_alloc();
+			return persistent_ptr<bucket[]>(oid);
+		}
+
+		persistent_ptr<bucket[]> &pending =
+			pending_buckets[thread_id::get()];
+		assert(pending == nullptr);
+		if (rt->bucket_flags == 0)
+			make_persistent_atomic<bucket[]>(pop, pending,
+							 bucket_size);
+		else if (pmemobj_xalloc(pop.handle(), pending.raw_ptr(), bytes,
+					0, flags, nullptr, nullptr) != 0)
+			throw std::bad_alloc();
+		return pending;
+	}
+
+	/**
+	 * Register the allocation class of bucket arrays. The default
+	 * classes align objects to no more than a cache line, so geometries
+	 * aligned wider get a class of their own.
+	 * @return allocation flags of bucket arrays, 0 for the default.
+	 */
+	uint64_t
+	bucket_class(pool_base &pop) const
+	{
+		if (Geometry::alignment <= CACHE_LINE_SIZE)
+			return 0;
+
+		pobj_alloc_class_desc desc;
+		desc.unit_size = bucket_size * sizeof(bucket);
+		desc.alignment = Geometry::alignment;
+		desc.units_per_block = 8;
+		desc.header_type = POBJ_HEADER_NONE;
+		desc.class_id = 0;
+		/* fall back to the default classes if the pool has no room */
+		return pmemobj_ctl_set(pop.handle(),
+				       "heap.alloc_class.new.desc",
+				       &desc) == 0
+			? POBJ_CLASS_ID(desc.class_id)
+			: 0;
+	}
+
+	/**
+	 * Prefetch every cache line of a bucket.
+	 */
+	static void
+	prefetch_bucket(const bucket *b)
+	{
+		for (size_type off = 0; off < sizeof(bucket);
+		     off += CACHE_LINE_SIZE)
+			PREFETCH(reinterpret_cast<const char *>(b) + off);
+	}
+
+	/**
+	 * Probe the entries of a bucket, slots in the middle of an inline
+	 * entry are never reported.
+	 */
+	static probe_mask
+	probe_entries(const bucket &b, partial_t token)
+	{
+		probe_mask pm = b.probe(token);
+		pm.match &= entry_mask;
+		pm.empty &= entry_mask;
+		return pm;
+	}
+
+	/**
+	 * Get the item of the entry at slot i whose header reads sv.
+	 * @return nullptr if the entry is empty or not committed yet.
+	 */
+	value_type *
+	entry_item(bucket &b, size_type i, uint64_t sv)
+	{
+		if (inline_kv) {
+			if (!(sv & inline_commit))
+				return nullptr;
+			return reinterpret_cast<value_type *>(&b.slots[i + 1]);
+		}
+		kv_ptr_t kv(sv);
+		if (kv.get_offset() == 0)
+			return nullptr;
+		return kv.get_address(my_pool_uuid);
+	}
+
+	/**
+	 * Get the pointer handed to accessors for the entry at slot i of
+	 * the bucket at offset b_off.
+	 */
+	static kv_ptr_t
+	entry_ptr(uint64_t b_off, size_type i, uint64_t sv)
+	{
+		if (inline_kv)
+			return kv_ptr_t(b_off + (i + 1) * sizeof(kv_ptr_u));
+		return kv_ptr_t(sv);
+	}
+
+	/**
+	 * Get the pool offset of bucket bucket_idx of a segment.
+	 */
+	static uint64_t
+	b_off_of(segment &seg, ptrdiff_t bucket_idx)
+	{
+		return seg.buckets.get_offset() +
+			(uint64_t)bucket_idx * sizeof(bucket);
+	}
+
+	/**
+	 * Read slot i, ordered before the payload of an inline entry.
+	 */
+	static uint64_t
+	load_slot(const bucket &b, size_type i)
+	{
+		return __atomic_load_n(&(b.slots[i].p.off), __ATOMIC_ACQUIRE);
+	}
+
+	/**
+	 * Whether an inline entry was claimed by a run that did not live
+	 * to commit it.
+	 */
+	bool
+	is_stale_claim(uint64_t sv) const
+	{
+		return inline_kv && (sv & inline_busy) &&
+			!(sv & inline_commit) &&
+			((sv >> inline_run_shift) & inline_run_mask) !=
+			(run_count.get_ro() & inline_run_mask);
+	}
+
+	/**
+	 * Pack an item into the payload word of an inline entry.
+	 */
+	static uint64_t
+	pack_item(const void *param)
+	{
+		uint64_t w = 0;
+		std::memcpy(&w, param, sizeof(value_type));
+		return w;
+	}
+
+	/**
+	 * Whether the entry whose header reads sv is being moved.
+	 */
+	static bool
+	is_moving(uint64_t sv)
+	{
+		return kv_ptr_t(sv).get_marker() == moving_marker;
+	}
+
+	/**
+	 * Wait for the migrator to finish with slot i, which read sv.
+	 */
+	static void
+	wait_moved(const bucket &b, size_type i, uint64_t sv)
+	{
+		while (load_slot(b, i) == sv)
+			std::this_thread::yield();
+	}
+
+	/**
+	 * Whether a move overlapped an operation that began at seq, which
+	 * may then have missed an item in flight between two layers.
+	 */
+	bool
+	moved_since(uint64_t seq) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return (seq & 1) ||
+			rt->moves_seq.load(std::memory_order_relaxed) != seq;
+	}
+
+	/**
+	 * Get the slot at a pool offset.
+	 */
+	uint64_t *
+	slot_at(uint64_t off) const
+	{
+		return static_cast<uint64_t *>(
+			pmemobj_direct(PMEMoid{my_pool_uuid, off}));
+	}
+
+	/**
+	 * Create the DRAM state of the table.
+	 */
+	void
+	init_volatile()
+	{
+		PMEMobjpool *pop =
+			pmemobj_pool_by_oid(PMEMoid{my_pool_uuid, 0});
+		rt = new runtime(pool_base(pop), &slab_head);
+		rt->bucket_flags = bucket_class(rt->pop);
+	}
+
+	/**
+	 * Finish or roll back the move in flight when the pool was closed.
+	 *
+	 * The source is dropped only if the destination got the whole entry
+	 * and the source still holds it, otherwise it is just unmarked.
+	 */
+	void
+	resolve_move(pool_base &pop)
+	{
+		if (mlog.src.get_ro() == 0)
+			return;
+
+		uint64_t *src = slot_at(mlog.src.get_ro());
+		uint64_t *dst = slot_at(mlog.dst.get_ro());
+		uint64_t val = mlog.val.get_ro();
+		bool done = *dst == val &&
+			(*src & ~(uint64_t)0x3) == (val & ~(uint64_t)0x3);
+		if (inline_kv)
+			done = done && src[1] == dst[1];
+
+		*src = done ? 0 : (*src & ~(uint64_t)0x3);
+		pop.persist(src, sizeof(uint64_t));
+		mlog.src.get_rw() = 0;
+		pop.persist(mlog.src);
+	}
+
+	/**
+	 * Publish a snapshot keeping inserts out of the bottom drain layers.
+	 */
+	void
+	publish_drain(size_type drain)
+	{
+		std::lock_guard<std::mutex> lock(rt->layers_lock);
+		layer_registry *old =
+			rt->layers.load(std::memory_order_relaxed);
+		layer_registry *ls = new layer_registry(*old);
+		ls->drain = drain;
+		rt->layers.store(ls, std::memory_order_release);
+		retire_layers(old);
+	}
+
+	/**
+	 * Move the entry at slot i of a bucket of the draining root layer
+	 * into the topmost layer with room for it.
+	 *
+	 * The source is marked moving, the destination filled and persisted,
+	 * and only then the source is cleared, so the entry is reachable at
+	 * any time. Lookups missing a key while moves_seq changes retry.
+	 * @return true if the entry left the root layer.
+	 */
+	bool
+	move_entry(pool_base &pop, const layer_desc &src_ld,
+		   ptrdiff_t src_segment_idx, bucket &b, uint64_t b_off,
+		   size_type i)
+	{
+		uint64_t sv = load_slot(b, i);
+		value_type *kv = entry_item(b, i, sv);
+		if (kv == nullptr || is_moving(sv))
+			return false;
+
+		hashcode_t h = hasher{}(kv->first);
+		partial_t token = token_of(h);
+		ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
+		epoch_manager::guard guard(rt->epochs);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+
+		bucket *dst_b = nullptr;
+		uint64_t dst_off = 0;
+		size_type dst_l = 0;
+		ptrdiff_t dst_segment_idx = 0;
+		size_type dst_i = 0;
+		for (size_type l = ls->num; l-- > ls->drain;) {
+			const layer_desc &ld = ls->layers[l];
+			ptrdiff_t segment_idx =
+				(ptrdiff_t)(h >> (hashcode_size - ld.segs_power));
+			segment &seg = ld.segments[segment_idx];
+			if (seg.buckets.get_offset() == 0) {
+				if (l != ls->num - 1)
+					continue;
+				expand(pop, ld.dir, segment_idx, true);
+			}
+			bucket &ub = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+			probe_mask pm = probe_entries(ub, token);
+
+			for (uint32_t m = pm.match; m; m &= m - 1) {
+				size_type j = (size_type)__builtin_ctz(m);
+				value_type *ukv = entry_item(ub, j, load_slot(ub, j));
+				if (ukv && key_matches(ukv, kv->first)) {
+					/* an upper copy makes this one stale */
+					if (!CAS(&(b.slots[i].p.off), sv, 0))
+						return false;
+					pop.persist(&(b.slots[i].p.off),
+						    sizeof(uint64_t));
+					occupancy_add(src_ld, src_segment_idx,
+						      -1);
+					if (!inline_kv)
+						retire_kv(sv);
+					return true;
+				}
+			}
+			if (dst_b == nullptr && pm.empty) {
+				dst_b = &ub;
+				dst_off = b_off_of(seg, bucket_idx);
+				dst_l = l;
+				dst_segment_idx = segment_idx;
+				dst_i = (size_type)__builtin_ctz(pm.empty);
+			}
+		}
+		if (dst_b == nullptr) {
+			/* every upper bucket is full, retried next pass */
+			expand(pop, ls->layers[ls->num - 1].dir, 0, false);
+			return false;
+		}
+
+		uint64_t &src = b.slots[i].p.off;
+		uint64_t &dst = dst_b->slots[dst_i].p.off;
+		uint64_t val = inline_kv ? ((((uint64_t)token) << token_shift) |
+					    inline_busy | inline_commit)
+					 : sv;
+		mlog.src.get_rw() = b_off + i * sizeof(kv_ptr_u);
+		mlog.dst.get_rw() = dst_off + dst_i * sizeof(kv_ptr_u);
+		mlog.val.get_rw() = val;
+		pop.persist(&mlog, sizeof(mlog));
+
+		rt->moves_seq.fetch_add(1);
+		bool moved = CAS(&src, sv, kv_ptr_t(sv).next_state());
+		if (moved) {
+			filter_add(ls->layers[dst_l], dst_segment_idx, bucket_idx,
+				   filter_bits(h));
+			if (inline_kv) {
+				uint64_t claim =
+					(((uint64_t)token) << token_shift) |
+					((run_count.get_ro() & inline_run_mask)
+					 << inline_run_shift) |
+					inline_busy;
+				moved = CAS(&dst, 0, claim);
+				if (moved) {
+					/* updates of the source recheck its
+					 * header, so the payload is final */
+					uint64_t &payload =
+						dst_b->slots[dst_i + 1].p.off;
+					__atomic_store_n(
+						&payload,
+						__atomic_load_n(
+							&(b.slots[i + 1].p.off),
+							__ATOMIC_ACQUIRE),
+						__ATOMIC_RELAXED);
+					pop.persist(&payload, sizeof(uint64_t));
+					__atomic_store_n(&dst, val,
+							 __ATOMIC_RELEASE);
+				}
+			} else {
+				moved = CAS(&dst, 0, val);
+			}
+			if (moved)
+				pop.persist(&dst, sizeof(uint64_t));
+			__atomic_store_n(&src, moved ? 0 : sv, __ATOMIC_RELEASE);
+			pop.persist(&src, sizeof(uint64_t));
+			if (moved) {
+				occupancy_add(ls->layers[dst_l],
+					      dst_segment_idx, 1);
+				occupancy_add(src_ld, src_segment_idx, -1);
+			}
+		}
+		rt->moves_seq.fetch_add(1, std::memory_order_release);
+
+		mlog.src.get_rw() = 0;
+		pop.persist(mlog.src);
+		return moved;
+	}
+
+	/**
+	 * Whether no entry, committed or being inserted, is left in a
+	 * segment.
+	 */
+	bool
+	segment_empty(segment &seg)
+	{
+		if (seg.buckets.get_offset() == 0)
+			return true;
+		bucket *bs = seg.buckets.get_address(my_pool_uuid);
+		for (size_type j = 0; j < bucket_size; j++) {
+			for (size_type i = 0; i < slots_num; i += entry_slots) {
+				uint64_t sv = load_slot(bs[j], i);
+				if (kv_ptr_t(sv).get_offset() != 0 &&
+				    !is_stale_claim(sv))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	bool
+	layer_empty(const layer_desc &ld)
+	{
+		size_type segs_num = 1UL << ld.segs_power;
+		for (size_type s = 0; s < segs_num; s++) {
+			if (!segment_empty(ld.segments[s]))
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Whether no segment of a layer holds a bucket array.
+	 */
+	static bool
+	layer_unused(const layer_desc &ld)
+	{
+		size_type segs_num = 1UL << ld.segs_power;
+		for (size_type s = 0; s < segs_num; s++) {
+			if (ld.segments[s].buckets.get_offset() != 0)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Unlock the entry at slot i of bucket b, whose header reads sv.
+	 * The payload is one word, so it holds the item from before or
+	 * after the write in flight.
+	 * @return the header read afterwards.
+	 */
+	uint64_t
+	unlock_stale(pool_base &pop, bucket &b, size_type i, uint64_t sv)
+	{
+		uint64_t &header = b.slots[i].p.off;
+		uint64_t unlocked =
+			sv & ~((inline_run_mask << inline_run_shift) | 0x3);
+		if (CAS(&header, sv, unlocked))
+			pop.persist(&header, sizeof(uint64_t));
+		return load_slot(b, i);
+	}
+
+	/**
+	 * Apply rmw to the value of the inline entry at slot i of bucket b,
+	 * whose header reads sv. The header is locked with the moving
+	 * marker meanwhile, which keeps moves, erases and other in-place
+	 * writes off the entry, and carries the run so that recover() can
+	 * tell a lock left by a crash.
+	 * @return false if the entry changed and must be looked up again.
+	 */
+	template <typename F>
+	bool
+	rmw_inline(pool_base &pop, persist_guard &group, bucket &b,
+		   size_type i, uint64_t sv, F &rmw)
+	{
+		if (unlikely(is_moving(sv))) {
+			wait_moved(b, i, sv);
+			return false;
+		}
+		uint64_t &header = b.slots[i].p.off;
+		uint64_t lock = kv_ptr_t(sv).next_state() |
+			((run_count.get_ro() & inline_run_mask)
+			 << inline_run_shift);
+		if (!CAS(&header, sv, lock))
+			return false;
+
+		/* update() may still replace the payload, it retries once
+		 * it sees the lock */
+		uint64_t &payload = b.slots[i + 1].p.off;
+		typename std::aligned_storage<sizeof(value_type),
+					      alignof(value_type)>::type item;
+		bool changed = false;
+		while (true) {
+			uint64_t cur = __atomic_load_n(&payload,
+						       __ATOMIC_ACQUIRE);
+			std::memcpy(&item, &cur, sizeof(value_type));
+			if (!rmw(reinterpret_cast<value_type *>(&item)->second))
+				break;
+			if (CAS(&payload, cur, pack_item(&item))) {
+				changed = true;
+				break;
+			}
+		}
+		__atomic_store_n(&header, sv, __ATOMIC_RELEASE);
+		/* a lock reaching PM unflushed is undone by recover() */
+		if (changed)
+			group.flush(pop, &header,
+				    entry_slots * sizeof(uint64_t));
+		return true;
+	}
+
+	/**
+	 * Apply rmw to an out-of-line value of at most 8 bytes with a CAS
+	 * on the value itself. The item never moves, the migrator only
+	 * moves the slot pointing to it.
+	 */
+	template <typename F>
+	bool
+	rmw_value(pool_base &pop, persist_guard &group, bucket &, size_type,
+		  uint64_t, value_type *kv, F &rmw, std::true_type)
+	{
+		using word_t = typename std::conditional<
+			sizeof(T) == 1, uint8_t,
+			typename std::conditional<
+				sizeof(T) == 2, uint16_t,
+				typename std::conditional<
+					sizeof(T) == 4, uint32_t,
+					uint64_t>::type>::type>::type;
+		word_t *w = reinterpret_cast<word_t *>(&(kv->second));
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type v;
+		while (true) {
+			word_t cur = __atomic_load_n(w, __ATOMIC_ACQUIRE);
+			std::memcpy(&v, &cur, sizeof(T));
+			if (!rmw(*reinterpret_cast<T *>(&v)))
+				return true;
+			word_t next;
+			std::memcpy(&next, &v, sizeof(T));
+			if (CAS(w, cur, next))
+				break;
+		}
+		group.flush(pop, w, sizeof(word_t));
+		return true;
+	}
+
+	/**
+	 * Apply rmw to a larger out-of-line value on a copy of the item,
+	 * which replaces the original with a CAS on the slot. Items of
+	 * slab_kv tables are carved from the thread's slab, so the PM
+	 * allocator is not involved.
+	 * @return false if the entry changed and must be looked up again.
+	 */
+	template <typename F>
+	bool
+	rmw_value(pool_base &pop, persist_guard &group, bucket &b, size_type i,
+		  uint64_t sv, value_type *kv, F &rmw, std::false_type)
+	{
+		if (unlikely(is_moving(sv))) {
+			wait_moved(b, i, sv);
+			return false;
+		}
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type v;
+		std::memcpy(&v, &(kv->second), sizeof(T));
+		if (!rmw(*reinterpret_cast<T *>(&v)))
+			return true;
+
+		value_type item(kv->first, *reinterpret_cast<T *>(&v));
+		uint64_t kv_off =
+			make_kv(pop, &item, allocate_kv_copy_construct);
+		uint64_t newcont = (sv & partial_mask) |
+			(kv_off & (~partial_mask));
+		uint64_t &slot = b.slots[i].p.off;
+		if (!CAS(&slot, sv, newcont)) {
+			free_kv(kv_off);
+			return false;
+		}
+		group.flush(pop, &slot, sizeof(uint64_t));
+		group.retire(sv);
+		return true;
+	}
+
+	/**
+	 * Whether an inline entry was locked by rmw_inline() in a run that
+	 * did not live to unlock it.
+	 */
+	bool
+	is_stale_lock(uint64_t sv) const
+	{
+		return inline_kv && is_moving(sv) && (sv & inline_commit) &&
+			((sv >> inline_run_shift) & inline_run_mask) !=
+			(run_count.get_ro() & inline_run_mask);
+	}
+
+	/**
+	 * Fill slot slot_idx of bucket b, chosen by an insert and seen
+	 * holding slot_old, with a new entry of the item at param.
+	 * @return false if another operation took the slot first.
+	 */
+	bool
+	place_entry(pool_base &pop, persist_guard &group, const layer_desc &ld,
+		    ptrdiff_t segment_idx, bucket &b, uint64_t b_off,
+		    size_type slot_idx, uint64_t slot_old, hashcode_t h,
+		    const void *param,
+		    void (*allocate_kv)(pool_base &,
+					persistent_ptr<value_type> &,
+					const void *),
+		    accessor *res)
+	{
+		check_hash(h);
+		ensure_scanned(pop, ld, segment_idx);
+		partial_t token = token_of(h);
+		uint64_t &slot = b.slots[slot_idx].p.off;
+		filter_add(ld, segment_idx, (ptrdiff_t)(h & (bucket_size - 1)),
+			   filter_bits(h));
+
+		if (inline_kv) {
+			/* claim, fill the payload, then commit */
+			uint64_t claim = (((uint64_t)token) << token_shift) |
+				((run_count.get_ro() & inline_run_mask)
+				 << inline_run_shift) |
+				inline_busy;
+			if (!CAS(&slot, slot_old, claim))
+				return false;
+
+			/* the entry lies in one line, so the header never
+			 * reaches PM before its payload */
+			uint64_t &payload = b.slots[slot_idx + 1].p.off;
+			__atomic_store_n(&payload, pack_item(param),
+					 __ATOMIC_RELAXED);
+			__atomic_store_n(&slot,
+					 (((uint64_t)token) << token_shift) |
+						 inline_busy | inline_commit,
+					 __ATOMIC_RELEASE);
+			group.flush(pop, &slot, entry_slots * sizeof(uint64_t));
+			occupancy_add(ld, segment_idx, 1);
+			if (res)
+				res->set(this,
+					 entry_ptr(b_off, slot_idx, slot));
+			return true;
+		}
+
+		uint64_t kv_off = make_kv(pop, param, allocate_kv);
+		uint64_t newcont = (((uint64_t)token) << token_shift) ^
+			(kv_off & (~partial_mask));
+
+		/* the slot was seen empty, lose if anyone took it */
+		if (!CAS(&slot, 0, newcont)) {
+			free_kv(kv_off);
+			return false;
+		}
+		group.flush(pop, &slot, sizeof(uint64_t));
+		occupancy_add(ld, segment_idx, 1);
+		if (res)
+			res->set(this, kv_ptr_t(newcont));
+		return true;
+	}
+
+	/**
+	 * Count an item in or out of a segment.
+	 */
+	void
+	occupancy_add(const layer_desc &ld, ptrdiff_t segment_idx, int64_t n)
+	{
+		count_items(n);
+		if (ld.occupancy[segment_idx].fetch_add(
+			    n, std::memory_order_relaxed) +
+			    n <=
+		    0)
+			rt->shrink_pending.store(true,
+						 std::memory_order_relaxed);
+	}
+
+	/**
+	 * Record a change of the item count. Each thread is the only writer
+	 * of its counters, so no atomic read-modify-write is needed.
+	 */
+	void
+	count_items(int64_t n)
+	{
+		std::atomic<int64_t> &c = rt->counters[thread_id::get()].items;
+		c.store(c.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	void
+	count_segments(int64_t n)
+	{
+		std::atomic<int64_t> &c =
+			rt->counters[thread_id::get()].segments;
+		c.store(c.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	/**
+	 * Compare key with the key of an item whose token matched it,
+	 * counting the false positives of tokens.
+	 */
+	template <typename K>
+	bool
+	key_matches(const value_type *kv, const K &key)
+	{
+		if (key_equal{}(kv->first, key))
+			return true;
+		std::atomic<uint64_t> &c =
+			rt->counters[thread_id::get()].false_matches;
+		c.store(c.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		return false;
+	}
+
+	/**
+	 * Invalidate the count saved by persist_size() durably before the
+	 * first change of the table after it.
+	 */
+	void
+	drop_saved_size()
+	{
+		if (likely(!rt->size_saved.load(std::memory_order_acquire)))
+			return;
+		std::lock_guard<std::mutex> lock(rt->size_lock);
+		if (!rt->size_saved.load(std::memory_order_relaxed))
+			return;
+		pool_base pop = get_pool_base();
+		saved_size.valid.get_rw() = 0;
+		pop.persist(saved_size.valid);
+		rt->size_saved.store(false, std::memory_order_release);
+	}
+
+	/**
+	 * Read the bucket array of a segment once, so that an insert sees it
+	 * together with its retiring marker while shrink() unlinks it.
+	 */
+	static segment
+	load_segment(const segment &seg)
+	{
+		segment s;
+		s.buckets.off =
+			__atomic_load_n(&(seg.buckets.off), __ATOMIC_ACQUIRE);
+		return s;
+	}
+
+	/**
+	 * Whether inserts must keep out of a segment being reclaimed.
+	 */
+	static bool
+	is_retiring(const segment &seg)
+	{
+		return seg.buckets.get_marker() == retiring_marker;
+	}
+
+	/**
+	 * Unlink and free the bucket arrays of up to reclaim_batch segments
+	 * that turn out empty.
+	 *
+	 * Segments are marked retiring first, so that inserts keep out of
+	 * them, and checked once every insert that did not see the marker
+	 * has left. Arrays are logged before being unlinked and freed after
+	 * a second grace period, since readers may still hold them.
+	 * @return number of segments freed.
+	 */
+	size_type
+	reclaim_segments(pool_base &pop, const segment_ref *cands, size_type n)
+	{
+		bool marked[reclaim_batch];
+		for (size_type k = 0; k < n; k++) {
+			segment &seg = cands[k].ld->segments[cands[k].idx];
+			uint64_t off = seg.buckets.off;
+			marked[k] = off != 0 && seg.buckets.get_marker() == 0 &&
+				CAS(&(seg.buckets.off), off,
+				    off | retiring_marker);
+		}
+		rt->epochs.synchronize();
+
+		filter_word *filters[reclaim_batch];
+		size_type logged = 0;
+		for (size_type k = 0; k < n; k++) {
+			if (!marked[k])
+				continue;
+			segment &seg = cands[k].ld->segments[cands[k].idx];
+			if (!segment_empty(seg)) {
+				__atomic_store_n(&(seg.buckets.off),
+						 seg.buckets.get_offset(),
+						 __ATOMIC_RELEASE);
+				continue;
+			}
+			rlog[logged].seg.get_rw() = pmemobj_oid(&seg).off;
+			rlog[logged].buckets = persistent_ptr<bucket[]>(
+				seg.buckets.raw_ptr(my_pool_uuid));
+			filters[logged] = cands[k].ld->filters[cands[k].idx]
+						  .exchange(nullptr);
+			logged++;
+		}
+		if (logged == 0)
+			return 0;
+		pop.persist(rlog, sizeof(reclaim_log) * logged);
+
+		for (size_type k = 0; k < n; k++) {
+			segment &seg = cands[k].ld->segments[cands[k].idx];
+			if (!marked[k] || seg.buckets.get_marker() == 0)
+				continue;
+			__atomic_store_n(&(seg.buckets.off), 0,
+					 __ATOMIC_RELEASE);
+			pop.persist(&(seg.buckets.off), sizeof(uint64_t));
+			count_segments(-1);
+			cands[k].ld->occupancy[cands[k].idx].store(
+				0, std::memory_order_relaxed);
+		}
+		rt->epochs.synchronize();
+
+		for (size_type k = 0; k < logged; k++) {
+			delete_persistent_atomic<bucket[]>(rlog[k].buckets,
+							   bucket_size);
+			rlog[k].seg.get_rw() = 0;
+			delete[] filter_untag(filters[k]);
+		}
+#ifdef DEBUG
+		std::cout << "reclaim " << logged << " segments" << std::endl;
+#endif
+		return logged;
+	}
+
+	/**
+	 * Publish a snapshot keeping inserts out of the top layer, or letting
+	 * them back in.
+	 */
+	void
+	publish_seal(bool seal)
+	{
+		std::lock_guard<std::mutex> lock(rt->layers_lock);
+		layer_registry *old =
+			rt->layers.load(std::memory_order_relaxed);
+		if (old->seal_top == seal)
+			return;
+		layer_registry *ls = new layer_registry(*old);
+		ls->seal_top = seal;
+		rt->layers.store(ls, std::memory_order_release);
+		retire_layers(old);
+	}
+
+	/**
+	 * Unlink the top layer if it has no segment left and free it once no
+	 * operation may still be reading it. An insert needing the layer back
+	 * meanwhile cancels by unsealing it, and so does an insert that
+	 * linked a segment of the layer before it saw the seal.
+	 * @return true if a layer was unlinked.
+	 */
+	bool
+	retire_top(pool_base &pop)
+	{
+		{
+			epoch_manager::guard guard(rt->epochs);
+			const layer_registry *ls =
+				rt->layers.load(std::memory_order_acquire);
+			if (ls->num < ls->drain + 2 ||
+			    !layer_unused(ls->layers[ls->num - 1]))
+				return false;
+		}
+		publish_seal(true);
+		rt->epochs.synchronize();
+
+		/* copied, since the snapshot holding it is retired */
+		layer_desc ld;
+		{
+			std::lock_guard<std::mutex> lock(rt->layers_lock);
+			layer_registry *old =
+				rt->layers.load(std::memory_order_relaxed);
+			/* appending a layer clears the seal as well */
+			if (!old->seal_top)
+				return false;
+			/* an insert that loaded the layers before the seal may
+			 * have linked a segment of the top layer since */
+			if (!layer_unused(old->layers[old->num - 1])) {
+				layer_registry *nls = new layer_registry(*old);
+				nls->seal_top = false;
+				rt->layers.store(nls,
+						 std::memory_order_release);
+				retire_layers(old);
+				return false;
+			}
+			directory *top = old->layers[old->num - 1].dir;
+			directory *lower = old->layers[old->num - 2].dir;
+			transaction::run(pop, [&] {
+				pmemobj_tx_add_range_direct(&(lower->next.off),
+							    sizeof(uint64_t));
+				lower->next = nullptr;
+				pmemobj_tx_add_range_direct(&(top_dir.off),
+							    sizeof(uint64_t));
+				top_dir.off = pmemobj_oid(lower).off;
+				retired_dir = persistent_ptr<directory>(
+					pmemobj_oid(top));
+			});
+
+			layer_registry *nls = new layer_registry(*old);
+			nls->num--;
+			nls->seal_top = false;
+			rt->layers.store(nls, std::memory_order_release);
+			ld = old->layers[old->num - 1];
+			retire_layers(old);
+		}
+		rt->epochs.synchronize();
+
+		free_retired_dir(pop);
+		free_layer_state(ld);
+#ifdef DEBUG
+		std::cout << "retire top layer with cap "
+			  << (1UL << ld.segs_power) << std::endl;
+#endif
+		return true;
+	}
+
+	/**
+	 * Free the unlinked layer recorded in retired_dir, whose segments
+	 * hold no bucket array.
+	 */
+	void
+	free_retired_dir(pool_base &pop)
+	{
+		if (retired_dir == nullptr)
+			return;
+		transaction::run(pop, [&] {
+			delete_persistent<segment[]>(
+				retired_dir->segments,
+				1UL << retired_dir->segs_power.get_ro());
+			delete_persistent<directory>(retired_dir);
+			retired_dir = nullptr;
+		});
+	}
+
+	/**
+	 * Settle the bucket arrays threads held in their pending slots when
+	 * the pool was closed: arrays a segment or the reservoir links stay,
+	 * the others are freed, once even if two slots hold them.
+	 */
+	void
+	resolve_pending(pool_base &pop)
+	{
+		std::vector<uint64_t> offs;
+		for (size_type k = 0; k < epoch_max_threads; k++) {
+			if (pending_buckets[k].raw().off != 0)
+				offs.push_back(pending_buckets[k].raw().off);
+		}
+		if (offs.empty())
+			return;
+		std::sort(offs.begin(), offs.end());
+		offs.erase(std::unique(offs.begin(), offs.end()), offs.end());
+
+		std::vector<uint64_t> linked;
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_relaxed);
+		for (size_type l = 0; l < ls->num; l++) {
+			size_type segs_num = 1UL << ls->layers[l].segs_power;
+			const segment *segs = ls->layers[l].segments;
+			for (size_type s = 0; s < segs_num; s++) {
+				uint64_t off = segs[s].buckets.off;
+				if (std::binary_search(offs.begin(), offs.end(),
+						       off))
+					linked.push_back(off);
+			}
+		}
+		for (size_type k = 0; k < reservoir_size; k++)
+			linked.push_back(reservoir[k].off);
+		std::sort(linked.begin(), linked.end());
+
+		/* clear the slots of linked arrays and all but one slot of
+		 * every other array, then free the arrays left */
+		std::vector<uint64_t> kept;
+		for (size_type k = 0; k < epoch_max_threads; k++) {
+			PMEMoid &pending = *pending_buckets[k].raw_ptr();
+			if (pending.off == 0)
+				continue;
+			if (!std::binary_search(linked.begin(), linked.end(),
+						pending.off) &&
+			    std::find(kept.begin(), kept.end(), pending.off) ==
+				    kept.end()) {
+				kept.push_back(pending.off);
+				continue;
+			}
+			pending.off = 0;
+			pop.persist(&pending.off, sizeof(uint64_t));
+		}
+		for (size_type k = 0; k < epoch_max_threads; k++) {
+			PMEMoid &pending = *pending_buckets[k].raw_ptr();
+			if (pending.off == 0)
+				continue;
+			pending.pool_uuid_lo = my_pool_uuid;
+			pmemobj_free(&pending);
+		}
+	}
+
+	/**
+	 * Free the bucket arrays shrink() unlinked before the pool was closed.
+	 */
+	void
+	resolve_reclaim(pool_base &pop)
+	{
+		for (size_type k = 0; k < reclaim_batch; k++) {
+			if (rlog[k].buckets == nullptr)
+				continue;
+			segment *seg = static_cast<segment *>(pmemobj_direct(
+				PMEMoid{my_pool_uuid, rlog[k].seg.get_ro()}));
+			if (seg != nullptr &&
+			    seg->buckets.get_offset() ==
+				    rlog[k].buckets.raw().off) {
+				seg->buckets.off = 0;
+				pop.persist(&(seg->buckets.off),
+					    sizeof(uint64_t));
+			}
+			delete_persistent_atomic<bucket[]>(rlog[k].buckets,
+							   bucket_size);
+			rlog[k].seg.get_rw() = 0;
+		}
+		free_retired_dir(pop);
+	}
+
+	/**
+	 * Unlink the drained root layer and free it once no operation may
+	 * still be reading it.
+	 */
+	void
+	unlink_root(pool_base &pop)
+	{
+		layer_desc ld;
+		{
+			std::lock_guard<std::mutex> lock(rt->layers_lock);
+			layer_registry *old =
+				rt->layers.load(std::memory_order_relaxed);
+			layer_registry *ls = new layer_registry();
+			ls->num = old->num - 1;
+			ls->drain = 0;
+			ls->seal_top = false;
+			for (size_type l = 0; l < ls->num; l++)
+				ls->layers[l] = old->layers[l + 1];
+			rt->layers.store(ls, std::memory_order_release);
+			ld = old->layers[0];
+			retire_layers(old);
+		}
+		rt->epochs.synchronize();
+
+		directory *root = ld.dir;
+		directory *next = root->next.get_address(my_pool_uuid);
+		size_type segs_num = 1UL << ld.segs_power;
+		int64_t freed = 0;
+		transaction::run(pop, [&] {
+			pmemobj_tx_add_range_direct(&(root_dir.off),
+						    sizeof(uint64_t));
+			root_dir.off = root->next.off;
+			pmemobj_tx_add_range_direct(&(next->prev.off),
+						    sizeof(uint64_t));
+			next->prev = nullptr;
+			for (size_type i = 0; i < segs_num; i++) {
+				segment &seg = ld.segments[i];
+				if (seg.buckets.get_offset() == 0)
+					continue;
+				freed++;
+				delete_persistent<bucket[]>(
+					persistent_ptr<bucket[]>(
+						seg.buckets.raw_ptr(
+							my_pool_uuid)),
+					bucket_size);
+			}
+			delete_persistent<segment[]>(root->segments, segs_num);
+			delete_persistent<directory>(
+				persistent_ptr<directory>(pmemobj_oid(root)));
+		});
+		count_segments(-freed);
+		free_layer_state(ld);
+#ifdef DEBUG
+		std::cout << "unlink root layer with cap " << segs_num
+			  << std::endl;
+#endif
+	}
+
+	/**
+	 * Run f(t) for every t in [0, nthreads), each on its own thread, and
+	 * rethrow the first exception thrown by any of them.
+	 */
+	template <typename F>
+	static void
+	parallel_run(size_type nthreads, F f)
+	{
+		if (nthreads == 1) {
+			f(0);
+			return;
+		}
+		std::vector<std::thread> threads;
+		std::vector<std::exception_ptr> errors(nthreads);
+		for (size_type t = 0; t < nthreads; t++) {
+			threads.emplace_back([&f, &errors, t] {
+				try {
+					f(t);
+				} catch (...) {
+					errors[t] = std::current_exception();
+				}
+			});
+		}
+		for (auto &th : threads)
+			th.join();
+		for (auto &e : errors) {
+			if (e)
+				std::rethrow_exception(e);
+		}
+	}
+
+	/* items of bulk_load() are converted only if they are not value_type */
+	static const value_type &
+	as_item(const value_type &v)
+	{
+		return v;
+	}
+
+	template <typename V>
+	static value_type
+	as_item(const V &v)
+	{
+		return value_type(v);
+	}
+
+	/**
+	 * Count the segments of the registered layers that have buckets.
+	 */
+	int64_t
+	linked_segments() const
+	{
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		int64_t segs = 0;
+		for (size_type l = 0; l < ls->num; l++) {
+			size_type segs_num = 1UL << ls->layers[l].segs_power;
+			for (size_type s = 0; s < segs_num; s++) {
+				if (ls->layers[l]
+					    .segments[s]
+					    .buckets.get_offset() != 0)
+					segs++;
+			}
+		}
+		return segs;
+	}
+
+	/**
+	 * Allocate segments, and layers once every segment is allocated,
+	 * until the open layers hold room for at least entries entries.
+	 * Segments are allocated by nthreads threads. The caller holds
+	 * migrate_lock.
+	 */
+	void
+	grow(pool_base &pop, uint64_t entries, size_type nthreads)
+	{
+		uint64_t seg_entries = bucket_size * entries_num;
+		while (true) {
+			layer_registry ls;
+			copy_layers(ls);
+			std::vector<segment_ref> missing;
+			uint64_t room = 0;
+			for (size_type l = ls.drain; l < ls.num; l++) {
+				const layer_desc &ld = ls.layers[l];
+				size_type segs_num = 1UL << ld.segs_power;
+				for (size_type s = 0; s < segs_num; s++) {
+					if (ld.segments[s].buckets.get_offset())
+						room += seg_entries;
+					else
+						missing.push_back(segment_ref{
+							&ld, (ptrdiff_t)s});
+				}
+			}
+			if (room >= entries)
+				return;
+
+			if (missing.empty()) {
+				expand(pop, ls.layers[ls.num - 1].dir, 0,
+				       false);
+				continue;
+			}
+			parallel_run(nthreads, [&](size_type t) {
+				for (size_type k = t; k < missing.size();
+				     k += nthreads)
+					expand(pop, missing[k].ld->dir,
+					       missing[k].idx, true);
+			});
+		}
+	}
+
+	/**
+	 * Insert the n items at first whose hash codes are in hs, the body
+	 * of bulk_load(). The caller holds migrate_lock.
+	 */
+	template <typename RandomIt>
+	size_type
+	bulk_insert(RandomIt first, const hashcode_t *hs, size_type n,
+		    size_type nthreads)
+	{
+		pool_base pop = get_pool_base();
+		grow(pop, (size() + n) * 100 / bulk_fill_percent, nthreads);
+
+		/* thread t owns buckets t, t + nthreads, ...; count the items
+		 * of every owner in a slice of the input per thread */
+		std::vector<size_type> cnt(nthreads * nthreads, 0);
+		parallel_run(nthreads, [&](size_type t) {
+			size_type *c = &cnt[t * nthreads];
+			for (size_type i = n * t / nthreads;
+			     i < n * (t + 1) / nthreads; i++)
+				c[(hs[i] & (bucket_size - 1)) % nthreads]++;
+		});
+		std::vector<size_type> owned(nthreads + 1, 0);
+		size_type sum = 0;
+		for (size_type o = 0; o < nthreads; o++) {
+			owned[o] = sum;
+			for (size_type t = 0; t < nthreads; t++) {
+				size_type c = cnt[t * nthreads + o];
+				cnt[t * nthreads + o] = sum;
+				sum += c;
+			}
+		}
+		owned[nthreads] = sum;
+		std::vector<size_type> by_owner(n);
+		parallel_run(nthreads, [&](size_type t) {
+			size_type *pos = &cnt[t * nthreads];
+			for (size_type i = n * t / nthreads;
+			     i < n * (t + 1) / nthreads; i++)
+				by_owner[pos[(hs[i] & (bucket_size - 1)) %
+					     nthreads]++] = i;
+		});
+
+		std::atomic<size_type> inserted(0);
+		parallel_run(nthreads, [&](size_type t) {
+			/* keeps the layers bulk_place() reads */
+			epoch_manager::guard guard(rt->epochs);
+			/* sort the owned items by bucket, bucket j at
+			 * start[j / nthreads] */
+			size_type nb = t < bucket_size
+				? (bucket_size - t - 1) / nthreads + 1
+				: 0;
+			std::vector<size_type> start(nb + 1, 0);
+			for (size_type k = owned[t]; k < owned[t + 1]; k++)
+				start[(hs[by_owner[k]] & (bucket_size - 1)) /
+				      nthreads + 1]++;
+			for (size_type j = 0; j < nb; j++)
+				start[j + 1] += start[j];
+			std::vector<size_type> pos(start.begin(),
+						   start.end() - 1);
+			std::vector<size_type> order(start[nb]);
+			for (size_type k = owned[t]; k < owned[t + 1]; k++) {
+				size_type i = by_owner[k];
+				order[pos[(hs[i] & (bucket_size - 1)) /
+					  nthreads]++] = i;
+			}
+
+			size_type placed = 0;
+			std::vector<size_type> overflow;
+			std::vector<bucket *> dirty;
+			for (size_type j = 0; j < nb; j++) {
+				for (size_type k = start[j]; k < start[j + 1];
+				     k++) {
+					size_type i = order[k];
+					bool present = false;
+					bucket *b = bulk_place(
+						pop,
+						as_item(first[(ptrdiff_t)i]),
+						hs[i], present);
+					if (b != nullptr) {
+						dirty.push_back(b);
+						placed++;
+					} else if (!present) {
+						overflow.push_back(i);
+					}
+				}
+				/* one flush per line, however many items */
+				std::sort(dirty.begin(), dirty.end());
+				dirty.erase(std::unique(dirty.begin(),
+							dirty.end()),
+					    dirty.end());
+				for (bucket *b : dirty)
+					pop.flush(b, sizeof(bucket));
+				dirty.clear();
+			}
+			pop.drain();
+
+			for (size_type i : overflow) {
+				const value_type &item =
+					as_item(first[(ptrdiff_t)i]);
+				if (generic_insert(item.first, hs[i], &item,
+						   allocate_kv_copy_construct,
+						   nullptr))
+					placed++;
+			}
+			inserted.fetch_add(placed);
+		});
+		return inserted.load();
+	}
+
+	/**
+	 * Put an item of bulk_load() into the lowest open layer with room
+	 * for it, without persisting the entry. The bucket of the item in
+	 * every layer is owned by the calling thread.
+	 * @return the bucket written, or nullptr if the key is present or
+	 * every open bucket is full, *present tells the two apart.
+	 */
+	bucket *
+	bulk_place(pool_base &pop, const value_type &v, hashcode_t h,
+		   bool &present)
+	{
+		partial_t token = token_of(h);
+		ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
+
+		while (true) {
+			const layer_registry *ls =
+				rt->layers.load(std::memory_order_acquire);
+			bucket *insert_b = nullptr;
+			size_type insert_l = 0;
+			ptrdiff_t insert_segment_idx = 0;
+			size_type slot_idx = 0;
+			/* as insert(), fill no layer above a missing segment */
+			bool above_null = false;
+
+			for (size_type l = 0; l < ls->num; l++) {
+				const layer_desc &ld = ls->layers[l];
+				ptrdiff_t segment_idx = (ptrdiff_t)(
+					h >> (hashcode_size - ld.segs_power));
+				segment seg =
+					load_segment(ld.segments[segment_idx]);
+				bool closed = l < ls->drain ||
+					(ls->seal_top && l == ls->num - 1);
+				if (seg.buckets.get_offset() == 0) {
+					above_null = above_null || !closed;
+					continue;
+				}
+				bucket &b = seg.buckets.get_address(
+					my_pool_uuid)[bucket_idx];
+				probe_mask pm = probe_entries(b, token);
+
+				for (uint32_t m = pm.match; m; m &= m - 1) {
+					size_type i =
+						(size_type)__builtin_ctz(m);
+					uint64_t sv = load_slot(b, i);
+					value_type *kv = entry_item(b, i, sv);
+					if (kv && key_matches(kv, v.first)) {
+						present = true;
+						return nullptr;
+					}
+				}
+
+				if (!insert_b && !closed && !above_null &&
+				    !is_retiring(seg) && pm.empty) {
+					insert_b = &b;
+					insert_l = l;
+					insert_segment_idx = segment_idx;
+					slot_idx = (size_type)__builtin_ctz(
+						pm.empty);
+				}
+			}
+			if (insert_b == nullptr)
+				return nullptr;
+
+			/* other writers may still take a slot, hence CAS */
+			uint64_t &slot = insert_b->slots[slot_idx].p.off;
+			filter_add(ls->layers[insert_l], insert_segment_idx,
+				   bucket_idx, filter_bits(h));
+			if (inline_kv) {
+				uint64_t claim =
+					(((uint64_t)token) << token_shift) |
+					((run_count.get_ro() &
+					  inline_run_mask)
+					 << inline_run_shift) |
+					inline_busy;
+				if (!CAS(&slot, 0, claim))
+					continue;
+				/* the entry lies in one line, so the header
+				 * never reaches PM before its payload */
+				__atomic_store_n(
+					&(insert_b->slots[slot_idx + 1].p.off),
+					pack_item(&v), __ATOMIC_RELAXED);
+				__atomic_store_n(
+					&slot,
+					(((uint64_t)token) << token_shift) |
+						inline_busy | inline_commit,
+					__ATOMIC_RELEASE);
+			} else {
+				uint64_t kv_off = make_kv(
+					pop, &v, allocate_kv_copy_construct);
+				uint64_t newcont =
+					(((uint64_t)token) << token_shift) ^
+					(kv_off & (~partial_mask));
+				if (!CAS(&slot, 0, newcont)) {
+					free_kv(kv_off);
+					continue;
+				}
+			}
+			occupancy_add(ls->layers[insert_l], insert_segment_idx,
+				      1);
+			return insert_b;
+		}
+	}
+
+	/**
+	 * Build the layer registry from the persistent directory chain.
+	 */
+	void
+	build_layers()
+	{
+		std::lock_guard<std::mutex> lock(rt->layers_lock);
+		layer_registry *ls = new layer_registry();
+		ls->num = 0;
+		ls->drain = 0;
+		ls->seal_top = false;
+		directory_ptr_t dp = root_dir;
+		while (dp != nullptr) {
+			directory *layer = dp.get_address(my_pool_uuid);
+			register_layer(ls, layer);
+			top_dir = dp;
+			dp = layer->next;
+		}
+		rt->layers.store(ls, std::memory_order_release);
+	}
+
+	/**
+	 * Publish the layers linked after the current top layer.
+	 *
+	 * Called by both the winner and the losers of an expansion, a
+	 * layer is only registered once.
+	 */
+	void
+	publish_layers()
+	{
+		std::lock_guard<std::mutex> lock(rt->layers_lock);
+		layer_registry *old =
+			rt->layers.load(std::memory_order_relaxed);
+		directory *top = old->layers[old->num - 1].dir;
+		if (top->next == nullptr)
+			return;
+
+		layer_registry *ls = new layer_registry(*old);
+		ls->seal_top = false;
+		directory_ptr_t dp = top->next;
+		while (dp != nullptr) {
+			directory *layer = dp.get_address(my_pool_uuid);
+			register_layer(ls, layer);
+			top_dir = dp;
+			dp = layer->next;
+		}
+		rt->layers.store(ls, std::memory_order_release);
+		/* readers may still hold the old snapshot */
+		retire_layers(old);
+	}
+
+	static void
+	register_layer(layer_registry *ls, directory *layer)
+	{
+		assert(ls->num < max_layers);
+		layer_desc &ld = ls->layers[ls->num++];
+		ld.dir = layer;
+		ld.segments = layer->segments.get();
+		ld.segs_power = layer->segs_power.get_ro();
+		ld.filters = new std::atomic<filter_word *>
+			[1UL << ld.segs_power]();
+		ld.occupancy = new std::atomic<int64_t>[1UL << ld.segs_power]();
+	}
+
+	static void
+	free_layer_state(layer_desc &ld)
+	{
+		size_type segs_num = 1UL << ld.segs_power;
+		for (size_type i = 0; i < segs_num; i++)
+			delete[] filter_untag(
+				ld.filters[i].load(std::memory_order_relaxed));
+		delete[] ld.filters;
+		delete[] ld.occupancy;
+	}
+
+	/**
+	 * Get the layout word recorded in the table: layout_revision, the
+	 * slots and alignment of buckets, and an id of the hasher taken from
+	 * the name of its type, since hash codes decide where keys are
+	 * stored and what their tokens are. It is never 0.
+	 */
+	static uint64_t
+	layout_word()
+	{
+		const char *name = typeid(hasher).name();
+		uint64_t hasher_id = XXH3_64bits(name, std::strlen(name));
+		uint64_t align_bits = 0;
+		while ((1ULL << align_bits) < Geometry::alignment)
+			align_bits++;
+		return (layout_revision << 56) | ((uint64_t)slots_num << 48) |
+			(align_bits << 40) | (hasher_id >> 24);
+	}
+
+	/**
+	 * Get the token of a hashcode. Like the filter bits, it is taken
+	 * from the top of a multiplicative remix, with another multiplier,
+	 * so that it varies among the keys of a bucket in every layer, and
+	 * tells keys apart however many bits segments and buckets take.
+	 */
+	static partial_t
+	token_of(hashcode_t h)
+	{
+		return (partial_t)((h * 0xC2B2AE3D27D4EB4FULL) >> token_shift);
+	}
+
+	/**
+	 * Get the filter bits of a hashcode. They are taken from the top of
+	 * a multiplicative remix, so they vary among the keys of a bucket,
+	 * which share both their segment and their bucket bits.
+	 */
+	static uint64_t
+	filter_bits(hashcode_t h)
+	{
+		uint64_t x = h * 0x9E3779B97F4A7C15ULL;
+		uint64_t bits = 0;
+		for (size_type i = 0; i < filter_hashes; i++)
+			bits |= 1ULL << ((x >> (58 - 6 * i)) & 63);
+		return bits;
+	}
+
+	static filter_word *
+	filter_tag(filter_word *f)
+	{
+		return reinterpret_cast<filter_word *>(
+			reinterpret_cast<uintptr_t>(f) | filter_partial);
+	}
+
+	static filter_word *
+	filter_untag(filter_word *f)
+	{
+		return reinterpret_cast<filter_word *>(
+			reinterpret_cast<uintptr_t>(f) &
+			~(filter_partial | filter_scanning));
+	}
+
+	/**
+	 * Whether the bucket may hold the key, false only if it surely
+	 * does not. Segments without a filter yet, or whose filter recover()
+	 * has not refilled yet, are always probed.
+	 */
+	bool
+	filter_may_contain(const layer_desc &ld, ptrdiff_t segment_idx,
+			   ptrdiff_t bucket_idx, uint64_t bits) const
+	{
+		filter_word *f = ld.filters[segment_idx].load(
+			std::memory_order_acquire);
+		if (f == nullptr || f != filter_untag(f))
+			return true;
+		return (f[bucket_idx].load(std::memory_order_relaxed) & bits) ==
+			bits;
+	}
+
+	/**
+	 * Record a key in the filter of its bucket before it is published.
+	 */
+	void
+	filter_add(const layer_desc &ld, ptrdiff_t segment_idx,
+		   ptrdiff_t bucket_idx, uint64_t bits)
+	{
+		std::atomic<filter_word *> &fp = ld.filters[segment_idx];
+		filter_word *f = fp.load(std::memory_order_acquire);
+		while (unlikely(filter_untag(f) == nullptr)) {
+			filter_word *nf = new filter_word[bucket_size]();
+			/* a filter being refilled stays untrusted */
+			nf = reinterpret_cast<filter_word *>(
+				reinterpret_cast<uintptr_t>(nf) |
+				reinterpret_cast<uintptr_t>(f));
+			if (fp.compare_exchange_strong(f, nf))
+				f = nf;
+			else
+				delete[] filter_untag(nf);
+		}
+		filter_untag(f)[bucket_idx].fetch_or(bits);
+	}
+
+	/**
+	 * Let lookups trust the filter of a segment recover() refilled.
+	 */
+	static void
+	filter_publish(const layer_desc &ld, ptrdiff_t segment_idx)
+	{
+		std::atomic<filter_word *> &fp = ld.filters[segment_idx];
+		filter_word *f = fp.load(std::memory_order_relaxed);
+		while (!fp.compare_exchange_weak(f, filter_untag(f),
+						 std::memory_order_release,
+						 std::memory_order_relaxed))
+			;
+	}
+
+	/**
+	 * Refill the filters and occupancy counts from every committed entry
+	 * of the table, with segments spread over nthreads threads. The
+	 * bucket arrays and out-of-line items found are marked in reach
+	 * unless it is nullptr.
+	 */
+	void
+	rebuild_layer_state(pool_base &pop, size_type nthreads,
+			    reach_map *reach)
+	{
+		layer_registry ls;
+		copy_layers(ls);
+		std::vector<segment_ref> segs;
+		for (size_type l = 0; l < ls.num; l++) {
+			size_type segs_num = 1UL << ls.layers[l].segs_power;
+			for (size_type s = 0; s < segs_num; s++)
+				segs.push_back(segment_ref{&(ls.layers[l]),
+							   (ptrdiff_t)s});
+		}
+		parallel_run(nthreads, [&](size_type t) {
+			for (size_type k = t; k < segs.size(); k += nthreads)
+				rebuild_segment_state(pop, *(segs[k].ld),
+						      segs[k].idx, reach);
+		});
+	}
+
+	/**
+	 * Refill the segment state first if an operation is about to add or
+	 * remove an item of a segment recover() has not refilled yet, so
+	 * that the item is counted either by the scan or by the operation.
+	 */
+	void
+	ensure_scanned(pool_base &pop, const layer_desc &ld,
+		       ptrdiff_t segment_idx)
+	{
+		filter_word *f =
+			ld.filters[segment_idx].load(std::memory_order_acquire);
+		if (unlikely(f != filter_untag(f)))
+			rebuild_segment_state(pop, ld, segment_idx, nullptr);
+	}
+
+	/**
+	 * Refill the filter and occupancy count of a segment, and let inserts
+	 * back into it if shrink() was checking it. Operations adding or
+	 * removing items of the segment meanwhile wait for the scan, see
+	 * ensure_scanned(). Returns at once if the segment is refilled
+	 * already.
+	 */
+	void
+	rebuild_segment_state(pool_base &pop, const layer_desc &ld,
+			      ptrdiff_t segment_idx, reach_map *reach)
+	{
+		std::atomic<filter_word *> &fp = ld.filters[segment_idx];
+		filter_word *f = fp.load(std::memory_order_acquire);
+		while (true) {
+			uintptr_t tags = reinterpret_cast<uintptr_t>(f) &
+				(filter_partial | filter_scanning);
+			if (tags == 0)
+				return;
+			if (tags == filter_partial &&
+			    fp.compare_exchange_weak(
+				    f,
+				    reinterpret_cast<filter_word *>(
+					    reinterpret_cast<uintptr_t>(f) |
+					    filter_scanning),
+				    std::memory_order_acquire))
+				break;
+			if (tags != filter_partial) {
+				std::this_thread::yield();
+				f = fp.load(std::memory_order_acquire);
+			}
+		}
+
+		epoch_manager::guard guard(rt->epochs);
+		segment &seg = ld.segments[segment_idx];
+		if (seg.buckets.get_offset() == 0) {
+			filter_publish(ld, segment_idx);
+			return;
+		}
+		if (seg.buckets.get_marker() != 0) {
+			seg.buckets.off = seg.buckets.get_offset();
+			pop.persist(&(seg.buckets.off), sizeof(uint64_t));
+		}
+		if (reach != nullptr)
+			reach->mark(seg.buckets.get_offset());
+
+		bucket *bs = seg.buckets.get_address(my_pool_uuid);
+		int64_t items = 0;
+		for (size_type j = 0; j < bucket_size; j++) {
+			for (size_type i = 0; i < slots_num; i += entry_slots) {
+				uint64_t sv = load_slot(bs[j], i);
+				if (unlikely(is_stale_lock(sv)))
+					sv = unlock_stale(pop, bs[j], i, sv);
+				value_type *kv = entry_item(bs[j], i, sv);
+				if (kv == nullptr)
+					continue;
+				items++;
+				if (slab_kv)
+					rt->kv_slabs->mark(
+						kv_ptr_t(sv).get_offset());
+				else if (!inline_kv && reach != nullptr)
+					reach->mark(kv_ptr_t(sv).get_offset());
+				filter_add(ld, segment_idx, (ptrdiff_t)j,
+					   filter_bits(hasher{}(kv->first)));
+			}
+		}
+		ld.occupancy[segment_idx].fetch_add(items,
+						    std::memory_order_relaxed);
+		if (rt->recount_items)
+			rt->base_items.fetch_add(items,
+						 std::memory_order_relaxed);
+		filter_publish(ld, segment_idx);
+	}
+
+	/**
+	 * Call fn(t, item) for every item of the table, t being the index of
+	 * the calling thread among nthreads, see parallel_for_each().
+	 */
+	template <typename F>
+	void
+	parallel_scan(F fn, size_type nthreads)
+	{
+		assert(nthreads > 0);
+		std::unique_lock<std::mutex> lock = lock_migrate();
+		layer_registry ls;
+		copy_layers(ls);
+		std::vector<segment_ref> segs;
+		for (size_type l = 0; l < ls.num; l++) {
+			size_type segs_num = 1UL << ls.layers[l].segs_power;
+			for (size_type s = 0; s < segs_num; s++)
+				segs.push_back(segment_ref{&(ls.layers[l]),
+							   (ptrdiff_t)s});
+		}
+
+		std::atomic<size_type> next(0);
+		std::atomic<bool> failed(false);
+		parallel_run(nthreads, [&](size_type t) {
+			auto item_fn = [&](const value_type &v) { fn(t, v); };
+			bool &scanning = rt->groups[thread_id::get()].scanning;
+			scanning = true;
+			try {
+				for (size_type k = next.fetch_add(1);
+				     k < segs.size() &&
+				     !failed.load(std::memory_order_relaxed);
+				     k = next.fetch_add(1))
+					scan_segment(segs[k].ld->segments
+							     [segs[k].idx],
+						     item_fn);
+			} catch (...) {
+				scanning = false;
+				failed.store(true, std::memory_order_relaxed);
+				throw;
+			}
+			scanning = false;
+		});
+	}
+
+	/**
+	 * Take migrate_lock, failing instead of deadlocking if a scan of
+	 * the calling thread holds it already.
+	 * @throw std::logic_error if called from a callback of
+	 * parallel_scan().
+	 */
+	std::unique_lock<std::mutex>
+	lock_migrate()
+	{
+		if (rt->groups[thread_id::get()].scanning)
+			throw std::logic_error(
+				"table reshaped from a for_each callback");
+		return std::unique_lock<std::mutex>(rt->migrate_lock);
+	}
+
+	/**
+	 * Read the next import_batch_bytes of blocks of a snapshot into an
+	 * empty batch.
+	 * @return false once the end block is read.
+	 */
+	bool
+	read_batch(snapshot_reader &r, import_batch &batch)
+	{
+		size_type bytes = 0;
+		while (bytes < import_batch_bytes) {
+			import_block blk;
+			blk.records = r.next_block(blk.data, blk.partition);
+			if (blk.records == 0)
+				return false;
+			bytes += blk.data.size();
+			batch.blocks.push_back(std::move(blk));
+		}
+		return true;
+	}
+
+	/**
+	 * Decode the blocks of a batch read into its items with nthreads
+	 * threads, each taking the next block not decoded yet, and release
+	 * the blocks. The hash code of the first record of every block is
+	 * checked against the hasher.
+	 */
+	void
+	decode_batch(const snapshot_reader &r, import_batch &batch,
+		     size_type nthreads)
+	{
+		std::atomic<size_type> next(0);
+		parallel_run(nthreads, [&](size_type) {
+			for (size_type k = next.fetch_add(1);
+			     k < batch.blocks.size(); k = next.fetch_add(1)) {
+				import_block &blk = batch.blocks[k];
+				size_t pos = 0;
+				blk.items.reserve(blk.records);
+				blk.hs.reserve(blk.records);
+				for (uint64_t i = 0; i < blk.records; i++) {
+					uint64_t h;
+					blk.items.push_back(
+						r.decode<Key, T, value_type>(
+							blk.data,
+							blk.partition, pos,
+							h));
+					if (i == 0 &&
+					    hasher{}(blk.items.back().first) !=
+						    h)
+						throw std::runtime_error(
+							"snapshot hash codes "
+							"do not match the "
+							"hasher");
+					blk.hs.push_back(h);
+				}
+				if (pos != blk.data.size())
+					throw std::runtime_error(
+						"corrupt snapshot");
+				std::vector<char>().swap(blk.data);
+			}
+		});
+
+		size_type n = 0;
+		for (import_block &blk : batch.blocks)
+			n += blk.items.size();
+		batch.items.reserve(n);
+		batch.hs.reserve(n);
+		for (import_block &blk : batch.blocks) {
+			for (value_type &v : blk.items)
+				batch.items.push_back(std::move(v));
+			batch.hs.insert(batch.hs.end(), blk.hs.begin(),
+					blk.hs.end());
+		}
+		batch.blocks.clear();
+	}
+
+	/**
+	 * Call fn(item) for every committed item of a segment, reading its
+	 * buckets in order with the lines ahead prefetched.
+	 */
+	template <typename F>
+	void
+	scan_segment(segment &seg, F &fn)
+	{
+		epoch_manager::guard guard(rt->epochs);
+		buckets_ptr_t b(
+			__atomic_load_n(&(seg.buckets.off), __ATOMIC_ACQUIRE));
+		if (b.get_offset() == 0)
+			return;
+		bucket *bs = b.get_address(my_pool_uuid);
+		for (size_type j = 0; j < scan_prefetch && j < bucket_size; j++)
+			prefetch_bucket(&bs[j]);
+		for (size_type j = 0; j < bucket_size; j++) {
+			if (j + scan_prefetch < bucket_size)
+				prefetch_bucket(&bs[j + scan_prefetch]);
+			value_type *kvs[slots_num];
+			size_type cnt = 0;
+			for (size_type i = 0; i < slots_num; i += entry_slots) {
+				uint64_t sv = load_slot(bs[j], i);
+				value_type *kv = entry_item(bs[j], i, sv);
+				if (kv == nullptr)
+					continue;
+				/* overlap the misses of out-of-line items */
+				if (!inline_kv)
+					PREFETCH(kv);
+				kvs[cnt++] = kv;
+			}
+			for (size_type i = 0; i < cnt; i++)
+				fn(static_cast<const value_type &>(*kvs[i]));
+		}
+	}
+
+	/**
+	 * Whether an object of the pool has a type the table allocates from
+	 * the heap.
+	 */
+	static bool
+	is_table_object(PMEMoid oid)
+	{
+		uint64_t type = pmemobj_type_num(oid);
+		return type == pmem::detail::type_num<directory>() ||
+			type == pmem::detail::type_num<segment>() ||
+			type == pmem::detail::type_num<bucket>() ||
+			(!inline_kv && !slab_kv &&
+			 type == pmem::detail::type_num<value_type>());
+	}
+
+	/**
+	 * Get the highest pool offset of an object the table may own.
+	 */
+	static uint64_t
+	table_objects_extent(pool_base &pop)
+	{
+		uint64_t extent = 0;
+		PMEMoid oid;
+		POBJ_FOREACH(pop.handle(), oid)
+		{
+			if (is_table_object(oid) && oid.off > extent)
+				extent = oid.off;
+		}
+		return extent;
+	}
+
+	/**
+	 * Free the objects of the table that nothing links, once the bucket
+	 * arrays and items of every segment are marked in reach. The heap
+	 * is walked by one thread, the objects found are freed by nthreads.
+	 */
+	void
+	free_unreachable(pool_base &pop, reach_map &reach, size_type nthreads)
+	{
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		for (size_type l = 0; l < ls->num; l++) {
+			reach.mark(pmemobj_oid(ls->layers[l].dir).off);
+			reach.mark(pmemobj_oid(ls->layers[l].segments).off);
+		}
+		for (size_type k = 0; k < reservoir_size; k++) {
+			if (reservoir[k].off != 0)
+				reach.mark(reservoir[k].off);
 		}
 
-		return false;
+		std::vector<PMEMoid> leaks;
+		PMEMoid oid;
+		POBJ_FOREACH(pop.handle(), oid)
+		{
+			if (is_table_object(oid) && !reach.marked(oid.off))
+				leaks.push_back(oid);
+		}
+		parallel_run(nthreads, [&](size_type t) {
+			for (size_type k = t; k < leaks.size(); k += nthreads)
+				pmemobj_free(&leaks[k]);
+		});
+#ifdef DEBUG
+		std::cout << "recover freed " << leaks.size()
+			  << " unreachable objects" << std::endl;
+#endif
+	}
+
+	/**
+	 * Check a hash code passed by the caller in debug builds.
+	 */
+	template <typename K>
+	static hashcode_t
+	checked_hash(const K &key, hashcode_t h)
+	{
+		assert(h == (hashcode_t)hasher{}(key));
+		(void)key;
+		return h;
+	}
+
+	/**
+	 * Warn once in debug builds if the first hash codes inserted agree
+	 * on the bits that pick segments or buckets, which then never spread
+	 * and make the table expand for nothing. Integers hashed with
+	 * std::hash, the identity in libstdc++, are the usual culprit.
+	 */
+	void
+	check_hash(hashcode_t h)
+	{
+#ifndef NDEBUG
+		if (rt->hash_samples.load(std::memory_order_relaxed) >=
+		    hash_check_samples)
+			return;
+		size_type n = rt->hash_samples.fetch_add(
+			1, std::memory_order_relaxed);
+		if (n >= hash_check_samples)
+			return;
+		uint64_t any = rt->hash_or.fetch_or(h) | h;
+		uint64_t all = rt->hash_and.fetch_and(h) & h;
+		uint64_t varied = any ^ all;
+		if (n + 1 == hash_check_samples &&
+		    ((varied >> token_shift) == 0 ||
+		     (varied & (bucket_size - 1)) == 0))
+			std::cerr << "NRHI: the high bits of the first "
+				  << hash_check_samples
+				  << " hash codes never change, use a hasher "
+				     "that mixes them such as default_hash"
+				  << std::endl;
+#else
+		(void)h;
+#endif
+	}
+
+	template <typename K>
+	static const hashcode_t *
+	checked_hashes(const K *keys, const hashcode_t *hashes, size_type n)
+	{
+#ifndef NDEBUG
+		for (size_type i = 0; i < n; i++)
+			checked_hash(keys[i], hashes[i]);
+#endif
+		(void)keys;
+		(void)n;
+		return hashes;
 	}
 
 	template <typename K>
-	bool generic_find(const K &key, accessor *res);
+	bool generic_find(const K &key, hashcode_t h, accessor *res);
+
+	template <typename K>
+	size_type generic_find_batch(const K *keys, const hashcode_t *hashes,
+				     size_type n, accessor *res, bool *found);
 
 	template <typename K>
-	bool generic_erase(const K &key);
+	bool generic_erase(const K &key, hashcode_t h);
+
+	bool generic_insert(const key_type &key, hashcode_t h,
+			    const void *param,
+			    void (*allocate_kv)(pool_base &,
+						persistent_ptr<value_type> &,
+						const void *),
+			    accessor *res);
 
-	bool generic_insert(const key_type &key, const void *param,
+	bool generic_update(const key_type &key, hashcode_t h,
+			    const void *param,
 			    void (*allocate_kv)(pool_base &,
 						persistent_ptr<value_type> &,
 						const void *),
 			    accessor *res);
 
-	bool generic_update(const key_type &key, const void *param,
+	bool generic_upsert(const key_type &key, hashcode_t h,
+			    const void *param,
 			    void (*allocate_kv)(pool_base &,
 						persistent_ptr<value_type> &,
 						const void *),
 			    accessor *res);
 
+	template <typename F>
+	bool generic_rmw(const key_type &key, hashcode_t h, F rmw);
+
+	bool
+	generic_store(const key_type &key, hashcode_t h, const T &value)
+	{
+		return generic_rmw(key, h, [&](T &v) {
+			std::memcpy(static_cast<void *>(&v), &value, sizeof(T));
+			return true;
+		});
+	}
+
+	template <typename U>
+	bool
+	generic_fetch_add(const key_type &key, hashcode_t h,
+			  typename counter_of<U>::type delta,
+			  typename counter_of<U>::type *previous)
+	{
+		using counter_t = typename counter_of<U>::type;
+		return generic_rmw(key, h, [&](T &v) {
+			counter_t c;
+			std::memcpy(&c, static_cast<void *>(&v),
+				    sizeof(counter_t));
+			if (previous)
+				*previous = c;
+			c = (counter_t)(c + delta);
+			std::memcpy(static_cast<void *>(&v), &c,
+				    sizeof(counter_t));
+			return true;
+		});
+	}
+
+	bool
+	generic_compare_exchange(const key_type &key, hashcode_t h,
+				 T &expected, const T &desired)
+	{
+		bool exchanged = false;
+		generic_rmw(key, h, [&](T &v) {
+			exchanged = std::memcmp(&v, &expected, sizeof(T)) == 0;
+			if (!exchanged) {
+				std::memcpy(static_cast<void *>(&expected), &v,
+					    sizeof(T));
+				return false;
+			}
+			std::memcpy(static_cast<void *>(&v), &desired,
+				    sizeof(T));
+			return true;
+		});
+		return exchanged;
+	}
+
 	/**
 	 * Get the persistent memory pool where hashmap
 	 * resides.
@@ -583,13 +4199,13 @@ protected:
 	pool_base
 	get_pool_base()
 	{
-		PMEMobjpool *pop =
-			pmemobj_pool_by_oid(PMEMoid{my_pool_uuid, 0});
-
-		return pool_base(pop);
+		return rt->pop;
 	}
 
 private:
+	/* layout the table was written with, see layout_word() */
+	p<uint64_t> layout;
+
 	/* ID of persistent memory pool where hash map resides. */
 	p<uint64_t> my_pool_uuid;
 
@@ -599,162 +4215,390 @@ private:
 	/* directory of hash table */
 	directory_ptr_t root_dir, top_dir;
 
-	/* access frequence*/
-	std::vector<directory *> dirs;
+	/* number of recover() calls, tags uncommitted inline entries */
+	p<uint64_t> run_count;
+
+	/* move of the migrator in flight */
+	move_log mlog;
+
+	/* bucket arrays and layer being reclaimed by shrink() */
+	reclaim_log rlog[reclaim_batch];
+	persistent_ptr<directory> retired_dir;
+
+	/* zeroed bucket arrays expand() links instead of allocating */
+	buckets_ptr_t reservoir[reservoir_size];
+
+	/* bucket array of every thread not linked yet, see alloc_buckets() */
+	persistent_ptr<bucket[]> pending_buckets[epoch_max_threads];
+
+	/* chain of the slabs holding out-of-line trivially copyable items */
+	PMEMoid slab_head;
+
+	/* item count saved before the pool was closed, see persist_size() */
+	size_checkpoint saved_size;
+
+	/* DRAM state, replaced by recover() without being read */
+	runtime *rt;
 
 }; /* End of class NRHI */
 
-template <typename Key, typename T, typename Hash, typename KeyEqual>
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
 template <typename K>
 bool
-NRHI<Key, T, Hash, KeyEqual>::generic_find(const K &key, accessor *res)
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_find(const K &key,
+						     hashcode_t h,
+						     accessor *res)
 {
-	hashcode_t h = hasher{}(key);
-	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
 
-	partial_t token = (partial_t)(h >> partial_shift);
+	partial_t token = token_of(h);
 	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
-	directory_ptr_t dp = top_dir;
+	uint64_t fbits = filter_bits(h);
 
-	int sz = dirs.size();
-	for (int i = sz - 1; i >= 0; i--) {
-		auto layer = dirs[i];
-		ptrdiff_t segment_idx =
-			(ptrdiff_t)(h >> (hashcode_size -
-					  layer->segs_power.get_ro()));
+	while (true) {
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
 
-		segment &seg = layer->segments[segment_idx];
-		if (seg.buckets.get_offset() == 0) {
-			continue;
+		for (size_type l = ls->num; l-- > 0;) {
+			const layer_desc &ld = ls->layers[l];
+			ptrdiff_t segment_idx = (ptrdiff_t)(
+				h >> (hashcode_size - ld.segs_power));
+			if (!filter_may_contain(ld, segment_idx, bucket_idx,
+						fbits))
+				continue;
+
+			segment &seg = ld.segments[segment_idx];
+			if (seg.buckets.get_offset() == 0) {
+				continue;
+			}
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+
+			for (uint32_t m = probe_entries(b, token).match; m;
+			     m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (kv && key_matches(kv, key)) {
+					if (res)
+						res->set(this,
+							 entry_ptr(b_off_of(seg,
+									    bucket_idx),
+								   i, sv));
+					return true;
+				}
+			}
 		}
-		bucket &b = seg.buckets.get_address(my_pool_uuid)[bucket_idx];
 
-		for (size_type i = 0; i < slots_num; i++) {
-			if (b.slots[i].p.get_offset() != 0 &&
-			    b.slots[i].token == token &&
-			    key_equal{}(b.slots[i]
-						.p.get_address(my_pool_uuid)
-						->first,
-					key)) {
-				if (res)
-					res->set(my_pool_uuid, b.slots[i].p);
-				return true;
+		if (!moved_since(seq))
+			return false;
+	}
+}
+
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
+template <typename K>
+typename NRHI<Key, T, Hash, KeyEqual, Geometry>::size_type
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_find_batch(
+	const K *keys, const hashcode_t *hashes, size_type n, accessor *res,
+	bool *found)
+{
+	hashcode_t hs[batch_size];
+	uint32_t ms[batch_size];
+	bool done[batch_size];
+	size_type nfound = 0;
+	epoch_manager::guard guard(rt->epochs);
+
+	for (size_type base = 0; base < n; base += batch_size) {
+		size_type cnt = n - base;
+		if (cnt > batch_size)
+			cnt = batch_size;
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+
+		/* hash all keys and prefetch their segment entries in every
+		 * layer */
+		for (size_type k = 0; k < cnt; k++) {
+			hs[k] = hashes ? hashes[base + k]
+				       : hasher{}(keys[base + k]);
+			done[k] = false;
+			if (res)
+				res[base + k].release();
+			if (found)
+				found[base + k] = false;
+		}
+		for (size_type l = ls->num; l-- > 0;) {
+			const layer_desc &ld = ls->layers[l];
+			size_type shift = hashcode_size - ld.segs_power;
+			for (size_type k = 0; k < cnt; k++)
+				PREFETCH(&(ld.segments[hs[k] >> shift]));
+		}
+
+		/* prefetch the bucket lines of every layer */
+		for (size_type l = ls->num; l-- > 0;) {
+			const layer_desc &ld = ls->layers[l];
+			size_type shift = hashcode_size - ld.segs_power;
+			for (size_type k = 0; k < cnt; k++) {
+				ptrdiff_t bucket_idx =
+					(ptrdiff_t)(hs[k] & (bucket_size - 1));
+				if (!filter_may_contain(
+					    ld, (ptrdiff_t)(hs[k] >> shift),
+					    bucket_idx, filter_bits(hs[k])))
+					continue;
+				segment &seg = ld.segments[hs[k] >> shift];
+				if (seg.buckets.get_offset() == 0)
+					continue;
+				prefetch_bucket(&(seg.buckets.get_address(
+					my_pool_uuid)[bucket_idx]));
+			}
+		}
+
+		/* probe top-down, prefetching candidate records before
+		 * comparing any of them */
+		for (size_type l = ls->num; l-- > 0;) {
+			const layer_desc &ld = ls->layers[l];
+			size_type shift = hashcode_size - ld.segs_power;
+			bucket *bs[batch_size];
+			uint64_t b_offs[batch_size];
+
+			for (size_type k = 0; k < cnt; k++) {
+				bs[k] = nullptr;
+				if (done[k])
+					continue;
+				ptrdiff_t bucket_idx =
+					(ptrdiff_t)(hs[k] & (bucket_size - 1));
+				if (!filter_may_contain(
+					    ld, (ptrdiff_t)(hs[k] >> shift),
+					    bucket_idx, filter_bits(hs[k])))
+					continue;
+				segment &seg = ld.segments[hs[k] >> shift];
+				if (seg.buckets.get_offset() == 0)
+					continue;
+				bs[k] = &(seg.buckets.get_address(
+					my_pool_uuid)[bucket_idx]);
+				b_offs[k] = b_off_of(seg, bucket_idx);
+
+				ms[k] = probe_entries(*bs[k], token_of(hs[k]))
+						.match;
+				/* inline items share the bucket line */
+				if (inline_kv)
+					continue;
+				for (uint32_t m = ms[k]; m; m &= m - 1)
+					PREFETCH(bs[k]->slots[__builtin_ctz(m)]
+							 .p.get_address(
+								 my_pool_uuid));
+			}
+
+			for (size_type k = 0; k < cnt; k++) {
+				if (bs[k] == nullptr)
+					continue;
+				bucket &b = *bs[k];
+				for (uint32_t m = ms[k]; m; m &= m - 1) {
+					size_type i =
+						(size_type)__builtin_ctz(m);
+					uint64_t sv = load_slot(b, i);
+					value_type *kv = entry_item(b, i, sv);
+					if (kv &&
+					    key_matches(kv, keys[base + k])) {
+						if (res)
+							res[base + k].set(
+								this,
+								entry_ptr(b_offs[k],
+									  i,
+									  sv));
+						if (found)
+							found[base + k] = true;
+						done[k] = true;
+						nfound++;
+						break;
+					}
+				}
 			}
 		}
+
+		/* misses may be items moved across layers meanwhile */
+		if (!moved_since(seq))
+			continue;
+		for (size_type k = 0; k < cnt; k++) {
+			if (done[k] ||
+			    !generic_find(keys[base + k], hs[k],
+					  res ? &res[base + k] : nullptr))
+				continue;
+			if (found)
+				found[base + k] = true;
+			nfound++;
+		}
 	}
 
-	return false;
+	return nfound;
 }
 
-template <typename Key, typename T, typename Hash, typename KeyEqual>
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
 template <typename K>
 bool
-NRHI<Key, T, Hash, KeyEqual>::generic_erase(const K &key)
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_erase(const K &key,
+						      hashcode_t h)
 {
-	hashcode_t h = hasher{}(key);
 	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
+	persist_guard group(*this);
+	drop_saved_size();
 	bool found = false;
 
-	partial_t token = (partial_t)(h >> partial_shift);
+	partial_t token = token_of(h);
 	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
-	directory_ptr_t dp = top_dir;
+	uint64_t fbits = filter_bits(h);
 
-	while (dp != nullptr) {
-		directory *layer = dp.get_address(my_pool_uuid);
-		ptrdiff_t segment_idx =
-			(ptrdiff_t)(h >> (hashcode_size -
-					  layer->segs_power.get_ro()));
+	bool retry = true;
+	while (retry) {
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		retry = false;
 
-		segment &seg = layer->segments[segment_idx];
-		if (seg.buckets.get_offset() == 0) {
-			dp = layer->prev;
-			continue;
-		}
-		bucket &b = seg.buckets.get_address(my_pool_uuid)[bucket_idx];
+		for (size_type l = ls->num; l-- > 0 && !retry;) {
+			const layer_desc &ld = ls->layers[l];
+			ptrdiff_t segment_idx = (ptrdiff_t)(
+				h >> (hashcode_size - ld.segs_power));
+			if (!filter_may_contain(ld, segment_idx, bucket_idx,
+						fbits))
+				continue;
 
-		for (size_type i = 0; i < slots_num; i++) {
-			if (b.slots[i].p.get_offset() != 0 &&
-			    b.slots[i].token == token &&
-			    key_equal{}(b.slots[i]
-						.p.get_address(my_pool_uuid)
-						->first,
-					key)) {
-				found = true;
-				kv_ptr_t tmp(b.slots[i].p.off);
-				if (CAS(&(b.slots[i].p.off), tmp.off, 0)) {
-					pop.persist(&(b.slots[i].p.off),
-						    sizeof(uint64_t));
-					PMEMoid oid = tmp.raw_ptr(my_pool_uuid);
-					pmemobj_free(&oid);
+			segment &seg = ld.segments[segment_idx];
+			if (seg.buckets.get_offset() == 0) {
+				continue;
+			}
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+
+			for (uint32_t m = probe_entries(b, token).match; m;
+			     m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (!kv || !key_matches(kv, key))
+					continue;
+				if (unlikely(is_moving(sv))) {
+					/* look for it again once it moved */
+					wait_moved(b, i, sv);
+					retry = true;
+					break;
 				}
+				ensure_scanned(pop, ld, segment_idx);
+				if (!CAS(&(b.slots[i].p.off), sv, 0)) {
+					retry = true;
+					break;
+				}
+				found = true;
+				group.flush(pop, &(b.slots[i].p.off),
+					    sizeof(uint64_t));
+				occupancy_add(ld, segment_idx, -1);
+				if (!inline_kv)
+					group.retire(sv);
 			}
 		}
-		dp = layer->prev;
+
+		if (!retry && !found && moved_since(seq))
+			retry = true;
 	}
 
 	return found;
 }
 
-template <typename Key, typename T, typename Hash, typename KeyEqual>
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
 bool
-NRHI<Key, T, Hash, KeyEqual>::generic_insert(
-	const key_type &key, const void *param,
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_insert(
+	const key_type &key, hashcode_t h, const void *param,
 	void (*allocate_kv)(pool_base &, persistent_ptr<value_type> &,
 			    const void *),
 	accessor *res)
 {
-	hashcode_t h = hasher{}(key);
 	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
+	persist_guard group(*this);
+	drop_saved_size();
 
-	partial_t token = (partial_t)(h >> partial_shift);
+	partial_t token = token_of(h);
 	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
 
-	size_type slot_idx = 0;
-
 	while (true) {
-		directory_ptr_t dp = root_dir;
-		directory_ptr_t effective_dp = nullptr;
-		directory_ptr_t insert_dp = nullptr;
-
-		ptrdiff_t segment_idx = -1;
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		bucket *insert_b = nullptr;
+		uint64_t insert_b_off = 0;
+		size_type insert_l = 0;
 		ptrdiff_t insert_segment_idx = -1;
+		size_type slot_idx = 0;
+		/* value the chosen slot was seen with */
+		uint64_t slot_old = 0;
+		/* lowest open layer whose segment is missing */
+		size_type null_l = ls->num;
+		ptrdiff_t segment_idx = -1, null_segment_idx = -1;
 
-		bool found_empty = false;
-
-		while (dp != nullptr) {
-			effective_dp = dp;
-			directory *layer = dp.get_address(my_pool_uuid);
+		for (size_type l = 0; l < ls->num; l++) {
+			const layer_desc &ld = ls->layers[l];
 
-			// first segment
-			segment_idx =
-				(ptrdiff_t)(h >> (hashcode_size -
-						  layer->segs_power.get_ro()));
+			segment_idx = (ptrdiff_t)(h >> (hashcode_size -
+							ld.segs_power));
 
-			segment &seg = layer->segments[segment_idx];
-			if (seg.buckets.get_offset() == 0)
-				break;
+			/* draining and sealed layers are never refilled */
+			bool closed = l < ls->drain ||
+				(ls->seal_top && l == ls->num - 1);
+			segment seg = load_segment(ld.segments[segment_idx]);
+			if (seg.buckets.get_offset() == 0) {
+				/* shrink() may have freed it while layers
+				 * above still hold the key */
+				if (!closed && null_l == ls->num) {
+					null_l = l;
+					null_segment_idx = segment_idx;
+				}
+				continue;
+			}
 
 			bucket &b = seg.buckets.get_address(
 				my_pool_uuid)[bucket_idx];
-			for (size_type i = 0; i < slots_num; i++) {
-				if (!found_empty &&
-				    b.slots[i].p.get_offset() == 0) {
-					insert_dp = dp;
-					insert_segment_idx = segment_idx;
-					slot_idx = i;
-					found_empty = true;
-				} else if (b.slots[i].p.get_offset() != 0 &&
-					   b.slots[i].token == token &&
-					   key_equal{}(
-						   b.slots[i]
-							   .p
-							   .get_address(
-								   my_pool_uuid)
-							   ->first,
-						   key)) {
+			probe_mask pm = probe_entries(b, token);
+			/* fill no layer above a missing segment, which is
+			 * allocated first */
+			bool drained = closed || is_retiring(seg) ||
+				null_l != ls->num;
+			if (!insert_b && !drained && pm.empty) {
+				insert_b = &b;
+				slot_idx = (size_type)__builtin_ctz(pm.empty);
+			} else if (inline_kv && !insert_b && !drained) {
+				for (size_type i = 0; i < slots_num;
+				     i += entry_slots) {
+					uint64_t sv = load_slot(b, i);
+					if (is_stale_claim(sv)) {
+						insert_b = &b;
+						slot_idx = i;
+						slot_old = sv;
+						break;
+					}
+				}
+			}
+			if (insert_b == &b) {
+				insert_b_off = b_off_of(seg, bucket_idx);
+				insert_l = l;
+				insert_segment_idx = segment_idx;
+			}
+
+			for (uint32_t m = pm.match; m; m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (kv && key_matches(kv, key)) {
 					if (res)
-						res->set(my_pool_uuid,
-							 b.slots[i].p);
+						res->set(this,
+							 entry_ptr(b_off_of(seg,
+									    bucket_idx),
+								   i, sv));
 #ifdef DEBUG
 					std::cout << "hashcode 0x" << std::hex
 						  << h << std::dec << " found"
@@ -764,59 +4608,37 @@ NRHI<Key, T, Hash, KeyEqual>::generic_insert(
 					return true;
 				}
 			}
-
-			dp = layer->next;
 		}
 
-		if (likely(found_empty)) {
-		FAST_INSERT:
-			persistent_ptr<value_type> newkv_ptr;
-			allocate_kv(pop, newkv_ptr, param);
-			uint64_t newcont =
-				(((uint64_t)token) << token_shift) ^
-				(newkv_ptr.raw().off & (~partial_mask));
-
-			segment &seg = insert_dp.get_address(my_pool_uuid)
-					       ->segments[insert_segment_idx];
-			bucket &b = seg.buckets.get_address(
-				my_pool_uuid)[bucket_idx];
-			uint64_t tmp_off = b.slots[slot_idx].p.off;
+		/* the key may have been in flight between two layers */
+		if (unlikely(moved_since(seq)))
+			continue;
 
+		if (likely(insert_b != nullptr)) {
 #ifdef DEBUG
 			std::cout << "insert hashcode 0x" << std::hex << h
-				  << std::dec << " to segment "
-				  << insert_segment_idx << " to bucket "
-				  << bucket_idx << std::endl;
+				  << std::dec << " to bucket " << bucket_idx
+				  << std::endl;
 #endif
-
-			if (CAS(&(b.slots[slot_idx].p.off), tmp_off, newcont)) {
-				pop.persist(&(b.slots[slot_idx].p.off),
-					    sizeof(uint64_t));
-				if (res)
-					res->set(my_pool_uuid,
-						 b.slots[slot_idx].p);
+			if (place_entry(pop, group, ls->layers[insert_l],
+					insert_segment_idx, *insert_b,
+					insert_b_off, slot_idx, slot_old, h,
+					param, allocate_kv, res))
 				return true;
-			} else {
-				pmemobj_free(newkv_ptr.raw_ptr());
-			}
 		} else {
-			bool is_null = (dp != nullptr);
-			insert_segment_idx =
-				(is_null)
-					? segment_idx
-					: (ptrdiff_t)(h >>
-						      (hashcode_size -
-						       effective_dp
-							       .get_address(
-								       my_pool_uuid)
-							       ->segs_power
-							       .get_ro() -
-						       1));
-			insert_dp = effective_dp;
-			if (expand(pop, insert_dp, insert_segment_idx,
-				   is_null)) {
-				goto FAST_INSERT;
-			} else {
+			/* a missing segment in layer null_l, or every layer
+			 * full */
+			bool is_null = (null_l < ls->num);
+			if (!is_null && ls->seal_top) {
+				/* take the top layer back from shrink() */
+				publish_seal(false);
+				continue;
+			}
+			directory *layer =
+				ls->layers[is_null ? null_l : ls->num - 1].dir;
+			if (!expand(pop, layer,
+				    is_null ? null_segment_idx : segment_idx,
+				    is_null)) {
 				std::cout << "expand failed" << std::endl;
 				return false;
 			}
@@ -826,82 +4648,426 @@ NRHI<Key, T, Hash, KeyEqual>::generic_insert(
 	return false;
 }
 
-template <typename Key, typename T, typename Hash, typename KeyEqual>
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
 bool
-NRHI<Key, T, Hash, KeyEqual>::generic_update(
-	const key_type &key, const void *param,
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_update(
+	const key_type &key, hashcode_t h, const void *param,
 	void (*allocate_kv)(pool_base &, persistent_ptr<value_type> &,
 			    const void *),
 	accessor *res)
 {
-	hashcode_t h = hasher{}(key);
 	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
+	persist_guard group(*this);
 	bool updated = false;
 
-	partial_t token = (ptrdiff_t)(h >> partial_shift);
+	partial_t token = token_of(h);
 	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
-	directory_ptr_t dp = top_dir;
-
-	while (dp != nullptr) {
-		directory *layer = dp.get_address(my_pool_uuid);
-		ptrdiff_t segment_idx =
-			(ptrdiff_t)(h >> (hashcode_size -
-					  layer->segs_power.get_ro()));
-		segment &seg = layer->segments[segment_idx];
-		if (seg.buckets.get_offset() == 0) {
-			dp = layer->prev;
-			continue;
-		}
-		bucket &b = seg.buckets.get_address(my_pool_uuid)[bucket_idx];
+	uint64_t fbits = filter_bits(h);
+
+	bool retry = true;
+	while (retry) {
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		retry = false;
+		updated = false;
+
+		for (size_type l = ls->num; l-- > 0 && !retry;) {
+			const layer_desc &ld = ls->layers[l];
+			ptrdiff_t segment_idx = (ptrdiff_t)(
+				h >> (hashcode_size - ld.segs_power));
+			if (!filter_may_contain(ld, segment_idx, bucket_idx,
+						fbits))
+				continue;
+			segment &seg = ld.segments[segment_idx];
+			if (seg.buckets.get_offset() == 0) {
+				continue;
+			}
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+
+			for (uint32_t m = probe_entries(b, token).match; m;
+			     m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (!kv || !key_matches(kv, key))
+					continue;
+
+				if (unlikely(is_moving(sv))) {
+					/* update the copy it moved to */
+					wait_moved(b, i, sv);
+					retry = true;
+					break;
+				}
 
-		for (size_type i = 0; i < slots_num; i++) {
-			if (b.slots[i].p.get_offset() != 0 &&
-			    b.slots[i].token == token &&
-			    key_equal{}(b.slots[i]
-						.p.get_address(my_pool_uuid)
-						->first,
-					key)) {
-				kv_ptr_t tmp(b.slots[i].p.off);
 				if (updated) {
-					if (CAS(&(b.slots[i].p.off), tmp.off,
-						0)) {
-						pop.persist(&(b.slots[i].p.off),
+					/* drop stale duplicates below */
+					ensure_scanned(pop, ld, segment_idx);
+					if (CAS(&(b.slots[i].p.off), sv, 0)) {
+						group.flush(pop,
+							    &(b.slots[i].p.off),
 							    sizeof(uint64_t));
-						PMEMoid oid = tmp.raw_ptr(
-							my_pool_uuid);
-						pmemobj_free(&oid);
+						occupancy_add(ld, segment_idx,
+							      -1);
+						if (!inline_kv)
+							group.retire(sv);
+					}
+				} else if (inline_kv) {
+					/* the key shares the payload word, so
+					 * a CAS on it cannot hit a recycled
+					 * entry */
+					uint64_t &payload = b.slots[i + 1].p.off;
+					uint64_t newcont = pack_item(param);
+					while (true) {
+						uint64_t cur = __atomic_load_n(
+							&payload,
+							__ATOMIC_ACQUIRE);
+						value_type *cur_kv =
+							reinterpret_cast<
+								value_type *>(
+								&cur);
+						if (!key_equal{}(cur_kv->first,
+								 key))
+							break;
+						if (CAS(&payload, cur,
+							newcont)) {
+							updated = true;
+							break;
+						}
+					}
+					/* a move may have copied the old
+					 * payload before the CAS */
+					if (updated &&
+					    load_slot(b, i) != sv) {
+						retry = true;
+						break;
+					}
+					if (updated) {
+						group.flush(pop, &payload,
+							    sizeof(uint64_t));
+						if (res)
+							res->set(this,
+								 entry_ptr(b_off_of(seg,
+										    bucket_idx),
+									   i, sv));
 					}
 				} else {
-					persistent_ptr<value_type> newkv_ptr;
-					allocate_kv(pop, newkv_ptr, param);
+					uint64_t kv_off = make_kv(
+						pop, param, allocate_kv);
 					uint64_t newcont =
-						(h & partial_mask) ^
-						(newkv_ptr.raw().off &
-						 (~partial_mask));
-					if (CAS(&(b.slots[i].p.off), tmp.off,
+						(((uint64_t)token)
+						 << token_shift) ^
+						(kv_off & (~partial_mask));
+					if (CAS(&(b.slots[i].p.off), sv,
 						newcont)) {
-						pop.persist(&(b.slots[i].p.off),
+						group.flush(pop,
+							    &(b.slots[i].p.off),
 							    sizeof(uint64_t));
-						PMEMoid oid = tmp.raw_ptr(
-							my_pool_uuid);
-						pmemobj_free(&oid);
+						group.retire(sv);
 						if (res)
-							res->set(my_pool_uuid,
-								 b.slots[i].p);
+							res->set(this,
+								 kv_ptr_t(newcont));
 						updated = true;
 					} else {
-						pmemobj_free(
-							newkv_ptr.raw_ptr());
+						free_kv(kv_off);
+						retry = true;
+						break;
 					}
 				}
 			}
 		}
-		dp = layer->prev;
+
+		if (!retry && !updated && moved_since(seq))
+			retry = true;
 	}
 
 	return updated;
 }
 
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
+bool
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_upsert(
+	const key_type &key, hashcode_t h, const void *param,
+	void (*allocate_kv)(pool_base &, persistent_ptr<value_type> &,
+			    const void *),
+	accessor *res)
+{
+	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
+	persist_guard group(*this);
+	drop_saved_size();
+
+	partial_t token = token_of(h);
+	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
+
+	/* an entry of the key seen by the walk */
+	struct key_entry {
+		const layer_desc *ld;
+		ptrdiff_t segment_idx;
+		bucket *b;
+		uint64_t b_off;
+		size_type i;
+		uint64_t sv;
+	};
+
+	while (true) {
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		bucket *insert_b = nullptr;
+		uint64_t insert_b_off = 0;
+		size_type insert_l = 0;
+		ptrdiff_t insert_segment_idx = -1;
+		size_type slot_idx = 0;
+		/* value the chosen slot was seen with */
+		uint64_t slot_old = 0;
+		/* lowest open layer whose segment is missing */
+		size_type null_l = ls->num;
+		ptrdiff_t segment_idx = -1, null_segment_idx = -1;
+		/* entries of the key, lowest layer first */
+		key_entry found[max_layers];
+		size_type nfound = 0;
+		bool moving = false;
+
+		for (size_type l = 0; l < ls->num && !moving; l++) {
+			const layer_desc &ld = ls->layers[l];
+
+			segment_idx = (ptrdiff_t)(h >> (hashcode_size -
+							ld.segs_power));
+
+			/* draining and sealed layers are never refilled */
+			bool closed = l < ls->drain ||
+				(ls->seal_top && l == ls->num - 1);
+			segment seg = load_segment(ld.segments[segment_idx]);
+			if (seg.buckets.get_offset() == 0) {
+				/* layers above may still hold the key */
+				if (!closed && null_l == ls->num) {
+					null_l = l;
+					null_segment_idx = segment_idx;
+				}
+				continue;
+			}
+
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+			probe_mask pm = probe_entries(b, token);
+			/* as insert(), fill no layer above a missing segment */
+			bool drained = closed || is_retiring(seg) ||
+				null_l != ls->num;
+			if (!insert_b && !drained && pm.empty) {
+				insert_b = &b;
+				slot_idx = (size_type)__builtin_ctz(pm.empty);
+			} else if (inline_kv && !insert_b && !drained) {
+				for (size_type i = 0; i < slots_num;
+				     i += entry_slots) {
+					uint64_t sv = load_slot(b, i);
+					if (is_stale_claim(sv)) {
+						insert_b = &b;
+						slot_idx = i;
+						slot_old = sv;
+						break;
+					}
+				}
+			}
+			if (insert_b == &b) {
+				insert_b_off = b_off_of(seg, bucket_idx);
+				insert_l = l;
+				insert_segment_idx = segment_idx;
+			}
+
+			for (uint32_t m = pm.match; m; m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (!kv || !key_matches(kv, key))
+					continue;
+				if (unlikely(is_moving(sv))) {
+					/* walk again once it moved */
+					wait_moved(b, i, sv);
+					moving = true;
+					break;
+				}
+				if (nfound < max_layers)
+					found[nfound++] = key_entry{
+						&ld, segment_idx, &b,
+						b_off_of(seg, bucket_idx), i,
+						sv};
+			}
+		}
+		if (moving)
+			continue;
+
+		if (nfound != 0) {
+			/* replace the topmost entry as update() does */
+			key_entry &e = found[nfound - 1];
+			if (inline_kv) {
+				uint64_t &payload = e.b->slots[e.i + 1].p.off;
+				uint64_t newcont = pack_item(param);
+				bool assigned = false;
+				while (true) {
+					uint64_t cur = __atomic_load_n(
+						&payload, __ATOMIC_ACQUIRE);
+					value_type *cur_kv =
+						reinterpret_cast<value_type *>(
+							&cur);
+					if (!key_equal{}(cur_kv->first, key))
+						break;
+					if (CAS(&payload, cur, newcont)) {
+						assigned = true;
+						break;
+					}
+				}
+				/* the entry was erased, or a move may have
+				 * copied the old payload before the CAS */
+				if (!assigned || load_slot(*e.b, e.i) != e.sv)
+					continue;
+				group.flush(pop, &payload, sizeof(uint64_t));
+				if (res)
+					res->set(this,
+						 entry_ptr(e.b_off, e.i, e.sv));
+			} else {
+				uint64_t kv_off =
+					make_kv(pop, param, allocate_kv);
+				uint64_t newcont =
+					(((uint64_t)token) << token_shift) ^
+					(kv_off & (~partial_mask));
+				uint64_t &slot = e.b->slots[e.i].p.off;
+				if (!CAS(&slot, e.sv, newcont)) {
+					free_kv(kv_off);
+					continue;
+				}
+				group.flush(pop, &slot, sizeof(uint64_t));
+				group.retire(e.sv);
+				if (res)
+					res->set(this, kv_ptr_t(newcont));
+			}
+
+			/* drop stale duplicates in lower layers */
+			for (size_type k = 0; k + 1 < nfound; k++) {
+				uint64_t &slot =
+					found[k].b->slots[found[k].i].p.off;
+				ensure_scanned(pop, *found[k].ld,
+					       found[k].segment_idx);
+				if (!CAS(&slot, found[k].sv, 0))
+					continue;
+				group.flush(pop, &slot, sizeof(uint64_t));
+				occupancy_add(*found[k].ld,
+					      found[k].segment_idx, -1);
+				if (!inline_kv)
+					group.retire(found[k].sv);
+			}
+			return false;
+		}
+
+		/* the key may have been in flight between two layers */
+		if (unlikely(moved_since(seq)))
+			continue;
+
+		if (likely(insert_b != nullptr)) {
+			if (place_entry(pop, group, ls->layers[insert_l],
+					insert_segment_idx, *insert_b,
+					insert_b_off, slot_idx, slot_old, h,
+					param, allocate_kv, res))
+				return true;
+		} else {
+			/* a missing segment in layer null_l, or every layer
+			 * full */
+			bool is_null = (null_l < ls->num);
+			if (!is_null && ls->seal_top) {
+				/* take the top layer back from shrink() */
+				publish_seal(false);
+				continue;
+			}
+			directory *layer =
+				ls->layers[is_null ? null_l : ls->num - 1].dir;
+			if (!expand(pop, layer,
+				    is_null ? null_segment_idx : segment_idx,
+				    is_null))
+				throw std::runtime_error(
+					"failed to expand the table");
+		}
+	}
+}
+
+/**
+ * Apply rmw(value) to the value of key, where rmw returns false to leave
+ * the value as it is, and may be called more than once. Inline values and
+ * out-of-line values of at most 8 bytes are written in place with one
+ * CAS, larger ones through a copy of the item replacing it with a CAS on
+ * the slot. Either way the change is failure atomic, and nothing is
+ * flushed if rmw leaves the value as it is.
+ *
+ * The copy comes from the slab of the thread in slab_kv tables. Tables
+ * whose keys are not trivially copyable allocate it with the PM
+ * allocator instead, which may throw std::bad_alloc.
+ */
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  typename Geometry>
+template <typename F>
+bool
+NRHI<Key, T, Hash, KeyEqual, Geometry>::generic_rmw(const key_type &key,
+						    hashcode_t h, F rmw)
+{
+	static_assert(is_inline_storable<T>::value,
+		      "only trivially copyable values are written in place");
+	pool_base pop = get_pool_base();
+	epoch_manager::guard guard(rt->epochs);
+	persist_guard group(*this);
+
+	partial_t token = token_of(h);
+	ptrdiff_t bucket_idx = (ptrdiff_t)(h & (bucket_size - 1));
+	uint64_t fbits = filter_bits(h);
+
+	while (true) {
+		uint64_t seq = rt->moves_seq.load(std::memory_order_acquire);
+		const layer_registry *ls =
+			rt->layers.load(std::memory_order_acquire);
+		bool retry = false;
+
+		for (size_type l = ls->num; l-- > 0 && !retry;) {
+			const layer_desc &ld = ls->layers[l];
+			ptrdiff_t segment_idx = (ptrdiff_t)(
+				h >> (hashcode_size - ld.segs_power));
+			if (!filter_may_contain(ld, segment_idx, bucket_idx,
+						fbits))
+				continue;
+			segment &seg = ld.segments[segment_idx];
+			if (seg.buckets.get_offset() == 0)
+				continue;
+			bucket &b = seg.buckets.get_address(
+				my_pool_uuid)[bucket_idx];
+
+			for (uint32_t m = probe_entries(b, token).match; m;
+			     m &= m - 1) {
+				size_type i = (size_type)__builtin_ctz(m);
+				uint64_t sv = load_slot(b, i);
+				value_type *kv = entry_item(b, i, sv);
+				if (!kv || !key_matches(kv, key))
+					continue;
+
+				bool done = inline_kv
+					? rmw_inline(pop, group, b, i, sv, rmw)
+					: rmw_value(pop, group, b, i, sv, kv,
+						    rmw,
+						    std::integral_constant<
+							    bool,
+							    word_value>());
+				if (done)
+					return true;
+				retry = true;
+				break;
+			}
+		}
+
+		if (!retry && !moved_since(seq))
+			return false;
+	}
+}
+
 } /* namespace nrhi */
 } /* namespace obj */
 } /* namespace pmem */
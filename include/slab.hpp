@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#ifndef PMEMOBJ_NRHI_SLAB_HPP
+#define PMEMOBJ_NRHI_SLAB_HPP
+
+#include <libpmemobj++/pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "epoch.hpp"
+
+namespace pmem
+{
+namespace obj
+{
+namespace nrhi
+{
+
+/**
+ * Allocator of fixed size records carved out of PM slabs.
+ *
+ * Slabs come from a headerless allocation class and are chained from a
+ * persistent head owned by the caller; records carry no header at all.
+ * Each thread carves records from its own slab and keeps those it frees
+ * in a DRAM list, so neither allocation nor free takes the heap lock or
+ * a transaction. The free lists are rebuilt after a restart from the
+ * records the owner marks as still referenced.
+ *
+ * A record is persisted by the caller before it is linked anywhere. A
+ * slab is allocated straight into the head of the chain, so a crash
+ * leaves it either linked or free.
+ */
+template <typename T>
+class slab_allocator {
+public:
+	static const size_t records_per_slab = 256;
+
+	slab_allocator(pool_base r_pop, PMEMoid *r_head)
+	    : pop(r_pop),
+	      pool_uuid(pmemobj_oid(r_head).pool_uuid_lo),
+	      head(r_head)
+	{
+		pobj_alloc_class_desc desc;
+		desc.unit_size = sizeof(slab);
+		desc.alignment = 0;
+		desc.units_per_block = 64;
+		desc.header_type = POBJ_HEADER_NONE;
+		desc.class_id = 0;
+		/* fall back to the default classes if the pool has no room */
+		alloc_flags = pmemobj_ctl_set(pop.handle(),
+					      "heap.alloc_class.new.desc",
+					      &desc) == 0
+			? POBJ_CLASS_ID(desc.class_id)
+			: 0;
+	}
+
+	slab_allocator(const slab_allocator &) = delete;
+	slab_allocator &operator=(const slab_allocator &) = delete;
+
+	/**
+	 * Get an uninitialized record.
+	 * @return pool offset of the record.
+	 * @throw std::bad_alloc on allocation failure.
+	 */
+	uint64_t
+	allocate()
+	{
+		cache &c = caches[thread_id::get()];
+		if (c.free.empty() && c.next == records_per_slab)
+			refill(c);
+		if (!c.free.empty()) {
+			uint64_t off = c.free.back();
+			c.free.pop_back();
+			return off;
+		}
+		return c.slab + record_off(c.next++);
+	}
+
+	void
+	deallocate(uint64_t off)
+	{
+		cache &c = caches[thread_id::get()];
+		c.free.push_back(off);
+		if (c.free.size() < 2 * records_per_slab)
+			return;
+
+		/* hand records over to threads allocating more than they
+		 * free */
+		std::lock_guard<std::mutex> lock(shared_lock);
+		shared.insert(shared.end(), c.free.end() - records_per_slab,
+			      c.free.end());
+		c.free.resize(c.free.size() - records_per_slab);
+	}
+
+	/**
+	 * Forget all free records, every record is taken as free unless
+	 * marked before end_recovery().
+	 */
+	void
+	begin_recovery()
+	{
+		slabs.clear();
+		for (uint64_t off = head->off; off != 0;
+		     off = slab_at(off)->next)
+			slabs.push_back(off);
+		std::sort(slabs.begin(), slabs.end());
+		marks.reset(new std::atomic<uint64_t>[slabs.size() *
+						      mark_words]());
+	}
+
+	/**
+	 * Mark the record at a pool offset as referenced, thread safe.
+	 */
+	void
+	mark(uint64_t off)
+	{
+		auto it = std::upper_bound(slabs.begin(), slabs.end(), off);
+		if (it == slabs.begin())
+			return;
+		--it;
+		uint64_t rel = off - *it;
+		if (rel < record_off(0) || rel >= sizeof(slab))
+			return;
+		size_t r = (rel - record_off(0)) / sizeof(record);
+		size_t w = (size_t)(it - slabs.begin()) * mark_words + r / 64;
+		marks[w].fetch_or(1ULL << (r % 64), std::memory_order_relaxed);
+	}
+
+	void
+	end_recovery()
+	{
+		size_t n = thread_id::limit();
+		for (size_t i = 0; i < n; i++) {
+			caches[i].free.clear();
+			caches[i].next = records_per_slab;
+		}
+		shared.clear();
+		for (size_t s = 0; s < slabs.size(); s++) {
+			for (size_t r = 0; r < records_per_slab; r++) {
+				uint64_t w =
+					marks[s * mark_words + r / 64].load(
+						std::memory_order_relaxed);
+				if (!(w & (1ULL << (r % 64))))
+					shared.push_back(slabs[s] +
+							 record_off(r));
+			}
+		}
+		slabs.clear();
+		marks.reset();
+	}
+
+private:
+	/* offsets keep their two low bits free for markers */
+	static const size_t record_align = alignof(T) > 8 ? alignof(T) : 8;
+	using record =
+		typename std::aligned_storage<sizeof(T), record_align>::type;
+	static const size_t mark_words = (records_per_slab + 63) / 64;
+
+	struct slab {
+		/* pool offset of the next slab, 0 for the last one */
+		uint64_t next;
+		char padding[64 - sizeof(uint64_t)];
+		record records[records_per_slab];
+	};
+
+	/* padded to a cache line, new ignores extended alignment in C++11 */
+	struct cache {
+		std::vector<uint64_t> free;
+		/* pool offset of the slab records are carved from */
+		uint64_t slab;
+		/* next record of the slab never handed out */
+		size_t next;
+		char padding[64 - sizeof(std::vector<uint64_t>) -
+			     sizeof(uint64_t) - sizeof(size_t)];
+
+		/* nothing left to carve until the first refill */
+		cache() : slab(0), next(records_per_slab)
+		{
+		}
+	};
+
+	static size_t
+	record_off(size_t r)
+	{
+		return offsetof(slab, records) + r * sizeof(record);
+	}
+
+	slab *
+	slab_at(uint64_t off)
+	{
+		return static_cast<slab *>(
+			pmemobj_direct(PMEMoid{pool_uuid, off}));
+	}
+
+	/**
+	 * Take free records from the other threads, or a new slab if they
+	 * have none.
+	 */
+	void
+	refill(cache &c)
+	{
+		std::lock_guard<std::mutex> lock(shared_lock);
+		size_t n = shared.size();
+		if (n > records_per_slab)
+			n = records_per_slab;
+		c.free.assign(shared.end() - (ptrdiff_t)n, shared.end());
+		shared.resize(shared.size() - n);
+		if (!c.free.empty())
+			return;
+
+		/* the allocator sets the head in the same failure atomic
+		 * step, once link_slab() has chained the old head */
+		uint64_t old = head->off;
+		if (pmemobj_xalloc(pop.handle(), head, sizeof(slab), 0,
+				   alloc_flags, link_slab, &old) != 0)
+			throw std::bad_alloc();
+		c.slab = head->off;
+		c.next = 0;
+	}
+
+	/**
+	 * Constructor of a slab, chains it in front of the slab at the
+	 * pool offset arg points to.
+	 */
+	static int
+	link_slab(PMEMobjpool *pop, void *ptr, void *arg)
+	{
+		slab *s = static_cast<slab *>(ptr);
+		s->next = *static_cast<uint64_t *>(arg);
+		pmemobj_persist(pop, &(s->next), sizeof(uint64_t));
+		return 0;
+	}
+
+	pool_base pop;
+	uint64_t pool_uuid;
+	/* persistent head of the slab chain, written by the allocator */
+	PMEMoid *head;
+	uint64_t alloc_flags;
+
+	cache caches[epoch_max_threads];
+	/* records given up by their threads, also serializes new slabs */
+	std::mutex shared_lock;
+	std::vector<uint64_t> shared;
+
+	/* slab offsets and their record marks during recovery */
+	std::vector<uint64_t> slabs;
+	std::unique_ptr<std::atomic<uint64_t>[]> marks;
+};
+
+} /* namespace nrhi */
+} /* namespace obj */
+} /* namespace pmem */
+
+#endif /* PMEMOBJ_NRHI_SLAB_HPP */
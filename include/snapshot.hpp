@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#ifndef PMEMOBJ_NRHI_SNAPSHOT_HPP
+#define PMEMOBJ_NRHI_SNAPSHOT_HPP
+
+#include <libpmemobj++/p.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "xxhash.hpp"
+
+namespace pmem
+{
+namespace obj
+{
+namespace nrhi
+{
+
+/*
+ * A snapshot is a header followed by blocks of records and an end block.
+ * A record is the 64-bit hash code of its key, the lengths of the encoded
+ * key and value as 32-bit words, and the encoded key and value. Records
+ * of a block share the top partition_bits bits of their hash codes, and
+ * every block carries an XXH64 checksum of its header and records. All
+ * words are in host byte order.
+ */
+static const char snapshot_magic[8] = {'N', 'R', 'H', 'I',
+				       'S', 'N', 'A', 'P'};
+static const uint32_t snapshot_version = 1;
+/* records of a partition a writer buffers before writing a block */
+static const size_t snapshot_block_bytes = 64 * 1024;
+/* largest encoded record, so that a block stays below one more record */
+static const size_t snapshot_max_record_bytes = 16 * 1024 * 1024;
+/* top bits of hash codes partitioning the blocks at most */
+static const size_t snapshot_max_partition_bits = 16;
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t partition_bits;
+	/* XXH64 of the fields above */
+	uint64_t checksum;
+};
+
+struct snapshot_block {
+	/* bytes of records following the block, 0 for the end block */
+	uint64_t bytes;
+	/* records of the block, records of the snapshot for the end block */
+	uint64_t records;
+	uint64_t partition;
+	/* XXH64 of the records seeded with the XXH64 of the fields above */
+	uint64_t checksum;
+};
+
+struct snapshot_record {
+	uint64_t hash;
+	uint32_t key_bytes;
+	uint32_t value_bytes;
+};
+
+/**
+ * Encoding of keys and values in snapshots, specialize it for types
+ * neither trivially copyable nor string-like.
+ */
+template <typename T, typename = void>
+struct snapshot_codec;
+
+template <typename T>
+struct is_persistent_wrapper : std::false_type {
+};
+
+template <typename T>
+struct is_persistent_wrapper<p<T>> : std::true_type {
+};
+
+/* trivially copyable types are copied byte for byte */
+template <typename T>
+struct snapshot_codec<
+	T,
+	typename std::enable_if<std::is_trivially_copyable<T>::value &&
+				!is_persistent_wrapper<T>::value>::type> {
+	static size_t
+	size(const T &)
+	{
+		return sizeof(T);
+	}
+
+	static void
+	write(const T &v, char *dst)
+	{
+		std::memcpy(dst, &v, sizeof(T));
+	}
+
+	static T
+	read(const char *src, size_t n)
+	{
+		if (n != sizeof(T))
+			throw std::runtime_error("corrupt snapshot record");
+		T v;
+		std::memcpy(&v, src, sizeof(T));
+		return v;
+	}
+};
+
+/* string-like types are copied as their characters */
+template <typename T>
+struct snapshot_codec<
+	T,
+	typename std::enable_if<
+		!std::is_trivially_copyable<T>::value &&
+		!is_persistent_wrapper<T>::value &&
+		std::is_constructible<T, const char *, size_t>::value &&
+		std::is_convertible<decltype(std::declval<const T &>().c_str()),
+				    const char *>::value>::type> {
+	static size_t
+	size(const T &v)
+	{
+		return v.length();
+	}
+
+	static void
+	write(const T &v, char *dst)
+	{
+		std::memcpy(dst, v.c_str(), v.length());
+	}
+
+	static T
+	read(const char *src, size_t n)
+	{
+		return T(src, n);
+	}
+};
+
+/* persistent wrappers are encoded as the values they wrap */
+template <typename T>
+struct snapshot_codec<p<T>> {
+	static size_t
+	size(const p<T> &v)
+	{
+		return snapshot_codec<T>::size(v.get_ro());
+	}
+
+	static void
+	write(const p<T> &v, char *dst)
+	{
+		snapshot_codec<T>::write(v.get_ro(), dst);
+	}
+
+	static p<T>
+	read(const char *src, size_t n)
+	{
+		return p<T>(snapshot_codec<T>::read(src, n));
+	}
+};
+
+/**
+ * Writer of a snapshot to a stream, shared by the threads exporting
+ * records. Each thread appends records to its own buffer, which writes
+ * a partition out as a block once it holds snapshot_block_bytes.
+ */
+class snapshot_writer {
+public:
+	snapshot_writer(std::ostream &r_os, size_t r_partition_bits)
+	    : os(r_os), partition_bits(r_partition_bits), total(0)
+	{
+		if (partition_bits > snapshot_max_partition_bits)
+			throw std::invalid_argument("too many partition bits");
+		snapshot_header hdr;
+		std::memcpy(hdr.magic, snapshot_magic, sizeof(hdr.magic));
+		hdr.version = snapshot_version;
+		hdr.partition_bits = (uint32_t)partition_bits;
+		hdr.checksum = XXH64(&hdr, offsetof(snapshot_header, checksum),
+				     0);
+		put(&hdr, sizeof(hdr));
+	}
+
+	snapshot_writer(const snapshot_writer &) = delete;
+	snapshot_writer &operator=(const snapshot_writer &) = delete;
+
+	class buffer {
+	public:
+		explicit buffer(snapshot_writer &r_w)
+		    : w(r_w), parts(1UL << r_w.partition_bits)
+		{
+		}
+
+		buffer(const buffer &) = delete;
+		buffer &operator=(const buffer &) = delete;
+
+		/**
+		 * Append a record to the block of its partition.
+		 * @throw std::length_error if the record is larger than
+		 * snapshot_max_record_bytes.
+		 */
+		template <typename K, typename V>
+		void
+		add(uint64_t hash, const K &key, const V &value)
+		{
+			size_t p = w.partition_bits == 0
+				? 0
+				: (size_t)(hash >> (64 - w.partition_bits));
+			part &pt = parts[p];
+			size_t key_bytes = snapshot_codec<K>::size(key);
+			size_t value_bytes = snapshot_codec<V>::size(value);
+			if (key_bytes + value_bytes >
+			    snapshot_max_record_bytes - sizeof(snapshot_record))
+				throw std::length_error(
+					"item too large for a snapshot");
+			snapshot_record rec;
+			rec.hash = hash;
+			rec.key_bytes = (uint32_t)key_bytes;
+			rec.value_bytes = (uint32_t)value_bytes;
+			size_t off = pt.data.size();
+			pt.data.resize(off + sizeof(rec) + rec.key_bytes +
+				       rec.value_bytes);
+			char *dst = &pt.data[off];
+			std::memcpy(dst, &rec, sizeof(rec));
+			snapshot_codec<K>::write(key, dst + sizeof(rec));
+			snapshot_codec<V>::write(value,
+						 dst + sizeof(rec) +
+							 rec.key_bytes);
+			pt.records++;
+			if (pt.data.size() >= snapshot_block_bytes)
+				write_out(p);
+		}
+
+		/**
+		 * Write out the records left in every partition.
+		 */
+		void
+		flush()
+		{
+			for (size_t p = 0; p < parts.size(); p++) {
+				if (parts[p].records != 0)
+					write_out(p);
+			}
+		}
+
+	private:
+		struct part {
+			std::vector<char> data;
+			uint64_t records = 0;
+		};
+
+		void
+		write_out(size_t p)
+		{
+			w.write_block(p, parts[p].data, parts[p].records);
+			parts[p].data.clear();
+			parts[p].records = 0;
+		}
+
+		snapshot_writer &w;
+		std::vector<part> parts;
+	};
+
+	/**
+	 * Write the end block, once every buffer is flushed.
+	 * @return number of records written.
+	 */
+	uint64_t
+	finish()
+	{
+		snapshot_block blk;
+		blk.bytes = 0;
+		blk.records = total;
+		blk.partition = 0;
+		blk.checksum = XXH64(nullptr, 0, block_seed(blk));
+		put(&blk, sizeof(blk));
+		os.flush();
+		if (!os)
+			throw std::runtime_error("failed to write snapshot");
+		return total;
+	}
+
+	static uint64_t
+	block_seed(const snapshot_block &blk)
+	{
+		return XXH64(&blk, offsetof(snapshot_block, checksum), 0);
+	}
+
+private:
+	void
+	write_block(size_t p, const std::vector<char> &data, uint64_t records)
+	{
+		snapshot_block blk;
+		blk.bytes = data.size();
+		blk.records = records;
+		blk.partition = p;
+		blk.checksum = XXH64(data.data(), data.size(), block_seed(blk));
+
+		std::lock_guard<std::mutex> lock(os_lock);
+		put(&blk, sizeof(blk));
+		put(data.data(), data.size());
+		total += records;
+	}
+
+	void
+	put(const void *src, size_t n)
+	{
+		if (!os.write(static_cast<const char *>(src),
+			      (std::streamsize)n))
+			throw std::runtime_error("failed to write snapshot");
+	}
+
+	std::ostream &os;
+	size_t partition_bits;
+	std::mutex os_lock;
+	uint64_t total;
+};
+
+/**
+ * Reader of a snapshot from a stream, verifying every block read.
+ */
+class snapshot_reader {
+public:
+	explicit snapshot_reader(std::istream &r_is) : is(r_is), total(0)
+	{
+		snapshot_header hdr;
+		get(&hdr, sizeof(hdr));
+		if (std::memcmp(hdr.magic, snapshot_magic, sizeof(hdr.magic)) !=
+			    0 ||
+		    hdr.checksum !=
+			    XXH64(&hdr, offsetof(snapshot_header, checksum),
+				  0))
+			throw std::runtime_error("not a snapshot");
+		if (hdr.version != snapshot_version)
+			throw std::runtime_error(
+				"unsupported snapshot version");
+		if (hdr.partition_bits > snapshot_max_partition_bits)
+			throw std::runtime_error("corrupt snapshot");
+		partition_bits = hdr.partition_bits;
+	}
+
+	snapshot_reader(const snapshot_reader &) = delete;
+	snapshot_reader &operator=(const snapshot_reader &) = delete;
+
+	/**
+	 * Read the next block into data and its partition into partition.
+	 * @return number of records of the block, 0 at the end block.
+	 * @throw std::runtime_error if the snapshot is corrupt or
+	 * truncated.
+	 */
+	uint64_t
+	next_block(std::vector<char> &data, uint64_t &partition)
+	{
+		snapshot_block blk;
+		get(&blk, sizeof(blk));
+		uint64_t seed = snapshot_writer::block_seed(blk);
+		if (blk.bytes == 0) {
+			if (blk.checksum != XXH64(nullptr, 0, seed) ||
+			    blk.records != total)
+				throw std::runtime_error("corrupt snapshot");
+			return 0;
+		}
+		if (blk.records == 0 || blk.bytes > max_block_bytes ||
+		    blk.records > blk.bytes / sizeof(snapshot_record) ||
+		    blk.partition >> partition_bits != 0)
+			throw std::runtime_error("corrupt snapshot");
+		data.resize(blk.bytes);
+		get(data.data(), data.size());
+		if (blk.checksum != XXH64(data.data(), data.size(), seed))
+			throw std::runtime_error("corrupt snapshot");
+		total += blk.records;
+		partition = blk.partition;
+		return blk.records;
+	}
+
+	/**
+	 * Decode the record at pos of a block of the given partition,
+	 * advancing pos past it. Blocks may be decoded from several threads.
+	 * @return the item built from the record.
+	 * @throw std::runtime_error if the record overruns the block or its
+	 * hash code is outside the partition.
+	 */
+	template <typename K, typename V, typename Item>
+	Item
+	decode(const std::vector<char> &data, uint64_t partition, size_t &pos,
+	       uint64_t &hash) const
+	{
+		snapshot_record rec;
+		if (data.size() - pos < sizeof(rec))
+			throw std::runtime_error("corrupt snapshot record");
+		std::memcpy(&rec, &data[pos], sizeof(rec));
+		pos += sizeof(rec);
+		if (data.size() - pos < (size_t)rec.key_bytes + rec.value_bytes)
+			throw std::runtime_error("corrupt snapshot record");
+		if (partition_bits != 0 &&
+		    rec.hash >> (64 - partition_bits) != partition)
+			throw std::runtime_error("corrupt snapshot record");
+		hash = rec.hash;
+		const char *src = &data[pos];
+		pos += (size_t)rec.key_bytes + rec.value_bytes;
+		return Item(snapshot_codec<K>::read(src, rec.key_bytes),
+			    snapshot_codec<V>::read(src + rec.key_bytes,
+						    rec.value_bytes));
+	}
+
+	size_t partition_bits;
+
+private:
+	/* a writer ends a block once it reaches snapshot_block_bytes */
+	static const uint64_t max_block_bytes =
+		snapshot_block_bytes - 1 + snapshot_max_record_bytes;
+
+	void
+	get(void *dst, size_t n)
+	{
+		if (!is.read(static_cast<char *>(dst), (std::streamsize)n))
+			throw std::runtime_error("truncated snapshot");
+	}
+
+	std::istream &is;
+	uint64_t total;
+};
+
+} /* namespace nrhi */
+} /* namespace obj */
+} /* namespace pmem */
+
+#endif /* PMEMOBJ_NRHI_SNAPSHOT_HPP */
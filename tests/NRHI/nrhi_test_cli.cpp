@@ -82,6 +82,32 @@ get_item(nvobj::pool<root> &pop)
 	}
 }
 
+void
+set_item(nvobj::pool<root> &pop)
+{
+	auto map = pop.root()->cons;
+	assert(map != nullptr);
+
+	int key, value;
+	std::string keystr, valuestr;
+	std::cin >> keystr >> valuestr;
+	try {
+		key = stoi(keystr);
+		value = stoi(valuestr);
+	} catch (...) {
+		printf("%s %s are not valid integers\n", keystr.c_str(),
+		       valuestr.c_str());
+		return;
+	}
+
+	persistent_map_type::accessor r;
+	bool ret = map->insert_or_assign(
+		persistent_map_type::value_type(key, value), r);
+
+	printf("[SUCCESS] %s %d : %d\n", ret ? "inserted" : "assigned",
+	       (int)r->first, (int)r->second);
+}
+
 void
 free_item(nvobj::pool<root> &pop)
 {
@@ -113,6 +139,7 @@ print_help()
 	printf("command format:\n");
 	printf("  <op> [<key>]\n");
 	printf("  while <op> can be put/get/free/help/quit, <key> must be an integer\n");
+	printf("  set <key> <value>: insert or replace an item\n");
 }
 
 }
@@ -139,6 +166,8 @@ main(int argc, char *argv[])
 		});
 	} else {
 		pop = nvobj::pool<root>::open(path, LAYOUT);
+		/* also frees what a crash of the last session leaked */
+		pop.root()->cons->recover(1);
 	}
 
 	print_help();
@@ -156,6 +185,9 @@ main(int argc, char *argv[])
 			case OP::GET:
 				get_item(pop);
 				break;
+			case OP::UPDATE:
+				set_item(pop);
+				break;
 			case OP::DELETE:
 				free_item(pop);
 				break;
@@ -170,6 +202,7 @@ main(int argc, char *argv[])
 	}
 
 quit:
+	pop.root()->cons->close();
 	pop.close();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <chrono>
+#include <csignal>
+#include <memory>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hpp"
+#include "hasher.hpp"
+#include "nrhi.hpp"
+#include "polymorphic_string.hpp"
+
+#define LAYOUT "NRHI"
+#define KEYLEN 16
+#define COUNTERS 1024
+
+namespace nvobj = pmem::obj;
+
+namespace
+{
+/* hits and bytes of a counter, too large to be updated in place */
+struct traffic {
+	uint64_t hits;
+	uint64_t bytes;
+};
+
+/* inline entries, locked while updated */
+using inline_map_type = nvobj::nrhi::NRHI<nvobj::p<int>, nvobj::p<int>>;
+/* slab items whose value word is updated with a CAS */
+using word_map_type =
+	nvobj::nrhi::NRHI<nvobj::p<uint64_t>, nvobj::p<uint64_t>>;
+/* slab items replaced by updated copies */
+using slab_map_type = nvobj::nrhi::NRHI<nvobj::p<uint64_t>, traffic>;
+/* items replaced by copies from the PM allocator, hashed by the caller */
+using string_hasher = nvobj::nrhi::xxh3_hasher<KEYLEN>;
+using string_map_type =
+	nvobj::nrhi::NRHI<polymorphic_string, traffic, string_hasher,
+			  std::equal_to<polymorphic_string>>;
+
+struct root {
+	nvobj::persistent_ptr<inline_map_type> inline_map;
+	nvobj::persistent_ptr<word_map_type> word_map;
+	nvobj::persistent_ptr<slab_map_type> slab_map;
+	nvobj::persistent_ptr<string_map_type> string_map;
+};
+
+polymorphic_string
+string_key(uint64_t k)
+{
+	char buf[KEYLEN + 1];
+	snprintf(buf, sizeof(buf), "counter%09lu", (unsigned long)k);
+	return polymorphic_string(buf, KEYLEN);
+}
+
+template <typename Map, typename K>
+void
+add_traffic(Map &map, const K &key, uint64_t bytes)
+{
+	traffic expected = {0, 0};
+	traffic desired;
+	do {
+		desired.hits = expected.hits + 1;
+		desired.bytes = expected.bytes + bytes;
+	} while (!map.compare_exchange(key, expected, desired));
+}
+
+void
+add_traffic_hashed(string_map_type &map, const polymorphic_string &key,
+		   uint64_t bytes)
+{
+	string_map_type::hashcode_t h = string_hasher{}(key);
+	traffic expected = {0, 0};
+	traffic desired;
+	do {
+		desired.hits = expected.hits + 1;
+		desired.bytes = expected.bytes + bytes;
+	} while (!map.compare_exchange_hashed(key, h, expected, desired));
+}
+
+/* count ops_per_thread hits on random counters from thread_num threads */
+void
+run_counters(root *r, size_t thread_num, size_t ops_per_thread,
+	     bool all_tables)
+{
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_num; t++) {
+		threads.emplace_back([=] {
+			std::mt19937_64 rng(t + 1);
+			for (size_t i = 0; i < ops_per_thread; i++) {
+				uint64_t k = rng() % COUNTERS;
+				r->inline_map->fetch_add((int)k, 1);
+				if (!all_tables)
+					continue;
+				r->word_map->fetch_add_hashed(
+					k, word_map_type::hasher{}(k), 1);
+				add_traffic(*r->slab_map, k, k);
+				add_traffic_hashed(*r->string_map,
+						   string_key(k), k);
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+}
+
+uint64_t
+inline_total(inline_map_type &map)
+{
+	uint64_t total = 0;
+	map.for_each([&](const inline_map_type::value_type &v) {
+		total += (uint64_t)(int)v.second;
+	});
+	return total;
+}
+
+template <typename Map>
+uint64_t
+traffic_hits(Map &map)
+{
+	uint64_t hits = 0;
+	map.for_each([&](const typename Map::value_type &v) {
+		hits += v.second.hits;
+	});
+	return hits;
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+	// parse inputs
+	if (argc != 4) {
+		printf("usage: %s <pool_file> <thread_num> <ops_per_thread>\n",
+		       argv[0]);
+		printf("  <pool_file>: the pool file for kv store\n");
+		printf("  <thread_num>: the number of threads\n");
+		printf("  <ops_per_thread>: hits each thread counts\n");
+		exit(1);
+	}
+
+	const char *path = argv[1];
+	int tmp = atoi(argv[2]);
+	assert(tmp > 0);
+	size_t thread_num = static_cast<size_t>(tmp);
+	tmp = atoi(argv[3]);
+	assert(tmp > 0);
+	size_t ops_per_thread = static_cast<size_t>(tmp);
+	uint64_t expected = thread_num * ops_per_thread;
+	bool ok = true;
+
+	remove(path); // delete the mapped file.
+	nvobj::pool<root> pop = nvobj::pool<root>::create(
+		path, LAYOUT, PMEMOBJ_MIN_POOL * 1024, CREATE_MODE_RW);
+	nvobj::transaction::run(pop, [&] {
+		pop.root()->inline_map =
+			nvobj::make_persistent<inline_map_type>();
+		pop.root()->word_map = nvobj::make_persistent<word_map_type>();
+		pop.root()->slab_map = nvobj::make_persistent<slab_map_type>();
+		pop.root()->string_map =
+			nvobj::make_persistent<string_map_type>();
+	});
+	root *r = pop.root().get();
+	for (uint64_t k = 0; k < COUNTERS; k++) {
+		r->inline_map->insert(inline_map_type::value_type((int)k, 0));
+		r->word_map->insert(word_map_type::value_type(k, 0));
+		r->slab_map->insert(slab_map_type::value_type(k, {0, 0}));
+		polymorphic_string key = string_key(k);
+		r->string_map->insert_hashed(
+			string_map_type::value_type(key, {0, 0}),
+			string_hasher{}(key));
+	}
+
+	printf("Counting starts.\n");
+	auto start = std::chrono::high_resolution_clock::now();
+	run_counters(r, thread_num, ops_per_thread, true);
+	auto end = std::chrono::high_resolution_clock::now();
+	uint64_t word_total = 0;
+	r->word_map->for_each([&](const word_map_type::value_type &v) {
+		word_total += v.second;
+	});
+	printf("Counting finished in %f ms: inline %lu, word %lu, "
+	       "slab %lu, string %lu of %lu\n",
+	       std::chrono::duration_cast<std::chrono::nanoseconds>(end -
+								     start)
+			       .count() /
+		       1000000.0,
+	       inline_total(*r->inline_map), word_total,
+	       traffic_hits(*r->slab_map), traffic_hits(*r->string_map),
+	       expected);
+	ok = ok && inline_total(*r->inline_map) == expected &&
+		word_total == expected &&
+		traffic_hits(*r->slab_map) == expected &&
+		traffic_hits(*r->string_map) == expected;
+
+	/* a stale compare leaves the value as it is */
+	traffic stale = {0, 0};
+	ok = ok && !r->slab_map->compare_exchange(1, stale, {1, 1}) &&
+		stale.hits != 0;
+	traffic zero = {0, 0};
+	std::vector<polymorphic_string> keys;
+	std::vector<string_map_type::hashcode_t> hashes;
+	for (uint64_t k = 0; k < COUNTERS; k++) {
+		r->slab_map->store(k, zero);
+		keys.push_back(string_key(k));
+		hashes.push_back(string_hasher{}(keys.back()));
+		r->string_map->store_hashed(keys.back(), hashes.back(), zero);
+	}
+	ok = ok && traffic_hits(*r->slab_map) == 0 &&
+		traffic_hits(*r->string_map) == 0;
+
+	/* the other operations on keys hashed by the caller */
+	std::unique_ptr<bool[]> found(new bool[COUNTERS]);
+	ok = ok &&
+		r->string_map->find_batch_hashed(keys.data(), hashes.data(),
+						 COUNTERS,
+						 found.get()) == COUNTERS;
+	polymorphic_string spare = string_key(COUNTERS);
+	string_map_type::hashcode_t h = string_hasher{}(spare);
+	traffic one = {1, 1};
+	ok = ok && !r->string_map->update_hashed(
+			   string_map_type::value_type(spare, one), h);
+	ok = ok && r->string_map->insert_or_assign_hashed(
+			   string_map_type::value_type(spare, zero), h);
+	ok = ok && r->string_map->update_hashed(
+			   string_map_type::value_type(spare, one), h);
+	ok = ok && r->string_map->find_hashed(spare, h);
+	ok = ok && r->string_map->erase_hashed(spare, h) &&
+		!r->string_map->find_hashed(spare, h);
+
+	r->inline_map->close();
+	r->word_map->close();
+	r->slab_map->close();
+	r->string_map->close();
+	pop.close();
+
+	/* kill a process counting, leaving inline entries locked */
+	pid_t pid = fork();
+	if (pid == 0) {
+		pop = nvobj::pool<root>::open(path, LAYOUT);
+		r = pop.root().get();
+		r->inline_map->recover();
+		r->inline_map->wait_recovered();
+		while (true)
+			run_counters(r, thread_num, ops_per_thread, false);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+
+	pop = nvobj::pool<root>::open(path, LAYOUT);
+	r = pop.root().get();
+	r->inline_map->recover();
+	r->inline_map->wait_recovered();
+	uint64_t before = inline_total(*r->inline_map);
+	run_counters(r, thread_num, ops_per_thread, false);
+	uint64_t after = inline_total(*r->inline_map);
+	printf("After the crash: %lu hits counted of %lu\n", after - before,
+	       expected);
+	ok = ok && after - before == expected;
+
+	r->inline_map->close();
+	pop.close();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+/*
+ * Table type, YCSB load file parsing and pool setup shared by the drivers
+ * that bulk load a string table before measuring something else.
+ */
+
+#ifndef NRHI_TEST_LOAD_HPP
+#define NRHI_TEST_LOAD_HPP
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "hasher.hpp"
+#include "nrhi.hpp"
+#include "polymorphic_string.hpp"
+
+#define LAYOUT "NRHI"
+#define KEYLEN 16
+
+// 2^10 * 2^7 * 8 = 1048576
+#define HASH_POWER 10
+#define SEGS_POWER 7
+
+namespace nvobj = pmem::obj;
+
+namespace
+{
+using string_t = polymorphic_string;
+
+/* the keys are KEYLEN bytes long */
+using string_hasher = nvobj::nrhi::xxh3_hasher<KEYLEN>;
+
+using persistent_map_type = nvobj::nrhi::NRHI<string_t, string_t, string_hasher,
+					      std::equal_to<string_t>>;
+
+struct root {
+	nvobj::persistent_ptr<persistent_map_type> cons;
+};
+
+using namespace std::chrono;
+
+double
+elapsed_ms(high_resolution_clock::time_point start,
+	   high_resolution_clock::time_point end)
+{
+	return duration_cast<nanoseconds>(end - start).count() / 1000000.0;
+}
+
+/* the keys inserted by a YCSB load file, as items mapping to themselves */
+std::vector<persistent_map_type::value_type>
+read_load_items(const char *load_path)
+{
+	std::ifstream ifs_load(load_path);
+	if (!ifs_load.is_open()) {
+		printf("Failed to open %s.\n", load_path);
+		exit(1);
+	}
+
+	std::string opstr, keystr;
+	std::vector<persistent_map_type::value_type> load_items;
+	while (ifs_load >> opstr) {
+		OP op = parse_ycsb_op(opstr.c_str());
+		if (op == OP::PUT) {
+			ifs_load >> keystr;
+			string_t key(keystr.c_str() + 4, KEYLEN);
+			load_items.emplace_back(key, key);
+		}
+		getline(ifs_load, keystr);
+	}
+	ifs_load.close();
+	return load_items;
+}
+
+/* a new pool at path holding an empty table */
+nvobj::pool<root>
+create_table_pool(const char *path)
+{
+	remove(path); // delete the mapped file.
+	nvobj::pool<root> pop = nvobj::pool<root>::create(
+		path, LAYOUT, PMEMOBJ_MIN_POOL * 20480, CREATE_MODE_RW);
+	nvobj::transaction::run(pop, [&] {
+		pop.root()->cons = nvobj::make_persistent<persistent_map_type>(
+			HASH_POWER, SEGS_POWER);
+	});
+	return pop;
+}
+}
+
+#endif /* NRHI_TEST_LOAD_HPP */
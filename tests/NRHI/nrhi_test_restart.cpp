@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#include <atomic>
+#include <thread>
+
+#include "nrhi_test_load.hpp"
+
+int
+main(int argc, char *argv[])
+{
+	// parse inputs
+	if (argc != 4) {
+		printf("usage: %s <pool_file> <load_file> <thread_num>\n",
+		       argv[0]);
+		printf("  <pool_file>: the pool file for kv store\n");
+		printf("  <load_file>: the wordload file for load phase\n");
+		printf("  <thread_num>: the number of threads\n");
+		exit(1);
+	}
+
+	const char *path = argv[1];
+	int tmp = atoi(argv[3]);
+	assert(tmp > 0);
+	size_t thread_num = static_cast<size_t>(tmp);
+
+	std::vector<persistent_map_type::value_type> load_items =
+		read_load_items(argv[2]);
+
+	nvobj::pool<root> pop = create_table_pool(path);
+
+	printf("Load phase starts.\n");
+	size_t loaded = pop.root()->cons->bulk_load(
+		load_items.begin(), load_items.end(), thread_num);
+	printf("Load phase finished: %ld/%ld inserted\n", loaded,
+	       load_items.size());
+	pop.root()->cons->close();
+	pop.close();
+
+	printf("Restart starts.\n");
+	auto start = high_resolution_clock::now();
+	pop = nvobj::pool<root>::open(path, LAYOUT);
+	auto opened = high_resolution_clock::now();
+	auto map = pop.root()->cons;
+	map->recover();
+	auto recovered = high_resolution_clock::now();
+
+	/* the table is usable once recover() returns */
+	size_t first = 0;
+	while (first < load_items.size() &&
+	       !map->find(load_items[first].first))
+		first++;
+	auto first_found = high_resolution_clock::now();
+	if (first == load_items.size()) {
+		printf("No loaded item found after restart.\n");
+		exit(1);
+	}
+
+	/* lookups race with the filters being refilled */
+	std::atomic<size_t> found(0);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < thread_num; i++) {
+		threads.emplace_back(
+			[&](size_t tid) {
+				size_t n = 0;
+				for (size_t j = tid; j < load_items.size();
+				     j += thread_num) {
+					if (map->find(load_items[j].first))
+						n++;
+				}
+				found += n;
+			},
+			i);
+	}
+	for (auto &t : threads)
+		t.join();
+	auto looked_up = high_resolution_clock::now();
+	map->wait_recovered();
+	auto rebuilt = high_resolution_clock::now();
+
+	std::atomic<size_t> scanned(0);
+	map->parallel_for_each(
+		[&](const persistent_map_type::value_type &) { scanned++; },
+		thread_num);
+	auto walked = high_resolution_clock::now();
+
+	printf("Restart finished: %ld/%ld found\n", found.load(), loaded);
+	printf("open pool:             %f ms\n", elapsed_ms(start, opened));
+	printf("recover:               %f ms\n", elapsed_ms(opened, recovered));
+	printf("first lookup:          %f ms\n",
+	       elapsed_ms(start, first_found));
+	printf("all lookups:           %f ms (%ld threads)\n",
+	       elapsed_ms(first_found, looked_up), thread_num);
+	printf("filters rebuilt:       %f ms\n", elapsed_ms(start, rebuilt));
+	printf("scan:                  %f ms (%ld items)\n",
+	       elapsed_ms(rebuilt, walked), scanned.load());
+
+	std::ofstream ofs_restart("nrhi_restart.res");
+	ofs_restart << elapsed_ms(start, first_found) << std::endl;
+	ofs_restart.close();
+
+	map->close();
+	pop.close();
+	return scanned == loaded ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "nrhi.hpp"
+
+#define LAYOUT "NRHI"
+/* 2^4 * 2^2 * 8 = 512, so that the keys spread over many layers */
+#define HASH_POWER 4
+#define SEGS_POWER 2
+#define ITEMS_PER_THREAD 50000
+#define ROUNDS 8
+
+namespace nvobj = pmem::obj;
+
+namespace
+{
+using persistent_map_type =
+	nvobj::nrhi::NRHI<nvobj::p<uint64_t>, nvobj::p<uint64_t>>;
+
+struct root {
+	nvobj::persistent_ptr<persistent_map_type> cons;
+};
+
+/* key j of thread t in round r, distinct across threads and rounds */
+uint64_t
+key_of(size_t r, size_t t, size_t j)
+{
+	return ((uint64_t)r << 48) | ((uint64_t)t << 32) | j;
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+	// parse inputs
+	if (argc != 3) {
+		printf("usage: %s <pool_file> <thread_num>\n", argv[0]);
+		printf("  <pool_file>: the pool file for kv store\n");
+		printf("  <thread_num>: the number of inserting threads\n");
+		exit(1);
+	}
+
+	const char *path = argv[1];
+	int tmp = atoi(argv[2]);
+	assert(tmp > 0);
+	size_t thread_num = static_cast<size_t>(tmp);
+
+	remove(path); // delete the mapped file.
+	nvobj::pool<root> pop = nvobj::pool<root>::create(
+		path, LAYOUT, PMEMOBJ_MIN_POOL * 1024, CREATE_MODE_RW);
+	nvobj::transaction::run(pop, [&] {
+		pop.root()->cons =
+			nvobj::make_persistent<persistent_map_type>(
+				HASH_POWER, SEGS_POWER);
+	});
+	auto map = pop.root()->cons;
+
+	/* every round inserts while shrink() frees the segments and layers
+	 * the previous round emptied */
+	size_t lost = 0;
+	size_t freed = 0;
+	for (size_t r = 0; r < ROUNDS; r++) {
+		std::atomic<size_t> running(thread_num);
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < thread_num; t++) {
+			threads.emplace_back([&, t] {
+				for (size_t j = 0; j < ITEMS_PER_THREAD; j++) {
+					uint64_t k = key_of(r, t, j);
+					map->insert(persistent_map_type::value_type(
+						k, k));
+				}
+				running--;
+			});
+		}
+		while (running.load() != 0)
+			freed += map->shrink();
+		for (auto &t : threads)
+			t.join();
+
+		for (size_t t = 0; t < thread_num; t++) {
+			for (size_t j = 0; j < ITEMS_PER_THREAD; j++) {
+				uint64_t k = key_of(r, t, j);
+				if (!map->find(k))
+					lost++;
+				map->erase(k);
+			}
+		}
+		printf("round %ld: %ld segments freed, %ld items lost, "
+		       "capacity %ld\n",
+		       r, freed, lost, map->capacity());
+	}
+	freed += map->shrink();
+	size_t left = map->size();
+	printf("Shrink finished: %ld segments freed, %ld items lost, "
+	       "%ld items left\n",
+	       freed, lost, left);
+
+	map->close();
+	pop.close();
+	return lost == 0 && left == 0 ? 0 : 1;
+}
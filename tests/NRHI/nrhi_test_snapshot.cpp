@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright (c) 2020, Xinyu Li */
+
+#include "nrhi_test_load.hpp"
+
+int
+main(int argc, char *argv[])
+{
+	// parse inputs
+	if (argc != 5) {
+		printf("usage: %s <pool_file> <snapshot_file> <load_file> "
+		       "<thread_num>\n",
+		       argv[0]);
+		printf("  <pool_file>: the pool file for kv store\n");
+		printf("  <snapshot_file>: the file the table is exported "
+		       "to\n");
+		printf("  <load_file>: the wordload file for load phase\n");
+		printf("  <thread_num>: the number of threads\n");
+		exit(1);
+	}
+
+	const char *path = argv[1];
+	const char *snapshot_path = argv[2];
+	int tmp = atoi(argv[4]);
+	assert(tmp > 0);
+	size_t thread_num = static_cast<size_t>(tmp);
+
+	std::vector<persistent_map_type::value_type> load_items =
+		read_load_items(argv[3]);
+
+	nvobj::pool<root> pop = create_table_pool(path);
+
+	printf("Load phase starts.\n");
+	size_t loaded = pop.root()->cons->bulk_load(
+		load_items.begin(), load_items.end(), thread_num);
+	printf("Load phase finished: %ld/%ld inserted\n", loaded,
+	       load_items.size());
+
+	printf("Export starts.\n");
+	auto start = high_resolution_clock::now();
+	std::ofstream ofs_snapshot(snapshot_path, std::ios::binary);
+	uint64_t exported =
+		pop.root()->cons->export_snapshot(ofs_snapshot, thread_num);
+	ofs_snapshot.close();
+	auto end = high_resolution_clock::now();
+	double export_ms = elapsed_ms(start, end);
+	pop.root()->cons->close();
+	pop.close();
+
+	std::ifstream ifs_snapshot(snapshot_path,
+				   std::ios::binary | std::ios::ate);
+	double mbytes = ifs_snapshot.tellg() / 1048576.0;
+	ifs_snapshot.seekg(0);
+	printf("Export finished: %ld items, %f MB\n", exported, mbytes);
+
+	/* import into an empty table of a new pool */
+	pop = create_table_pool(path);
+
+	printf("Import starts.\n");
+	start = high_resolution_clock::now();
+	size_t imported =
+		pop.root()->cons->import_snapshot(ifs_snapshot, thread_num);
+	end = high_resolution_clock::now();
+	double import_ms = elapsed_ms(start, end);
+	ifs_snapshot.close();
+
+	auto map = pop.root()->cons;
+	size_t found = 0;
+	for (auto &item : load_items) {
+		if (map->find(item.first))
+			found++;
+	}
+	size_t scanned = 0;
+	map->for_each(
+		[&](const persistent_map_type::value_type &) { scanned++; });
+
+	printf("Import finished: %ld imported, %ld/%ld found, %ld scanned\n",
+	       imported, found, loaded, scanned);
+	printf("export: %f ms, %f MB/s (%ld threads)\n", export_ms,
+	       mbytes * 1000 / export_ms, thread_num);
+	printf("import: %f ms, %f MB/s (%ld threads)\n", import_ms,
+	       mbytes * 1000 / import_ms, thread_num);
+
+	std::ofstream ofs_res("nrhi_snapshot.res");
+	ofs_res << export_ms << " " << import_ms << std::endl;
+	ofs_res.close();
+
+	map->close();
+	pop.close();
+	return found == loaded && scanned == loaded ? 0 : 1;
+}
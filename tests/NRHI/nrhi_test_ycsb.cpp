@@ -16,14 +16,22 @@
 #include <vector>
 
 #include "common.hpp"
+#include "hasher.hpp"
 #include "nrhi.hpp"
 #include "polymorphic_string.hpp"
-#include "xxhash.hpp"
 
 #define LAYOUT "NRHI"
 #define KEYLEN 16
 #define LATENCY_ENABLE 1
 
+/* slots per bucket and bucket alignment, see bucket_geometry */
+#ifndef BUCKET_SLOTS
+#define BUCKET_SLOTS 8
+#endif
+#ifndef BUCKET_ALIGN
+#define BUCKET_ALIGN (BUCKET_SLOTS * 8)
+#endif
+
 // #define LOADFACTOR_TEST 1
 
 #ifdef MACRO_TEST
@@ -45,29 +53,12 @@ namespace
 using string_t = polymorphic_string;
 using pair_t = std::pair<OP, string_t>;
 
-class key_equal {
-public:
-	template <typename M, typename U>
-	bool
-	operator()(const M &lhs, const U &rhs) const
-	{
-		return lhs == rhs;
-	}
-};
-
-class string_hasher {
-public:
-	using transparent_key_equal = key_equal;
+/* the keys are KEYLEN bytes long */
+using string_hasher = nvobj::nrhi::xxh3_hasher<KEYLEN>;
 
-	size_t
-	operator()(const polymorphic_string &str) const
-	{
-		return XXH64(str.c_str(), str.length(), 0x9e3779b97f4a7c15);
-	}
-};
-
-using persistent_map_type = nvobj::nrhi::NRHI<string_t, string_t, string_hasher,
-					      std::equal_to<string_t>>;
+using persistent_map_type = nvobj::nrhi::NRHI<
+	string_t, string_t, string_hasher, std::equal_to<string_t>,
+	nvobj::nrhi::bucket_geometry<BUCKET_SLOTS, BUCKET_ALIGN>>;
 
 struct root {
 	nvobj::persistent_ptr<persistent_map_type> cons;
@@ -122,6 +113,7 @@ main(int argc, char *argv[])
 		});
 	} else {
 		pop = nvobj::pool<root>::open(path, LAYOUT);
+		pop.root()->cons->recover();
 	}
 
 	std::ifstream ifs_load(argv[2]), ifs_run(argv[3]);
@@ -151,6 +143,7 @@ main(int argc, char *argv[])
 
 #ifndef LOAD_TEST
 	printf("Load phase starts.\n");
+#ifdef LOADFACTOR_TEST
 	while (ifs_load >> opstr) {
 		OP op = parse_ycsb_op(opstr.c_str());
 		if (op == OP::PUT) {
@@ -160,12 +153,9 @@ main(int argc, char *argv[])
 			if (map->insert(persistent_map_type::value_type(key,
 									key))) {
 				loaded++;
-#ifdef LOADFACTOR_TEST
 				if (loaded % 20000 == 0)
-					ofs_loadfactor << (loaded * 1.0 /
-							   map->capacity())
+					ofs_loadfactor << map->load_factor()
 						       << std::endl;
-#endif
 			} else {
 				std::cout << "load " << keystr << " failed"
 					  << std::endl;
@@ -174,6 +164,21 @@ main(int argc, char *argv[])
 		}
 		getline(ifs_load, keystr);
 	}
+#else
+	std::vector<persistent_map_type::value_type> load_items;
+	while (ifs_load >> opstr) {
+		OP op = parse_ycsb_op(opstr.c_str());
+		if (op == OP::PUT) {
+			ifs_load >> keystr;
+			string_t key(keystr.c_str() + 4, KEYLEN);
+			load_items.emplace_back(key, key);
+		}
+		getline(ifs_load, keystr);
+	}
+	total_load = load_items.size();
+	loaded = map->bulk_load(load_items.begin(), load_items.end(),
+				thread_num);
+#endif
 
 	ifs_load.close();
 	printf("Load phase finished: %ld/%ld inserted\n", loaded, total_load);
@@ -210,6 +215,9 @@ main(int argc, char *argv[])
 	}
 	ifs_run.close();
 
+	/* inserts expanding the table link preallocated segments */
+	map->start_refiller();
+
 	std::vector<std::thread> threads;
 	size_t op_cnt = op_total / thread_num;
 	auto start = high_resolution_clock::now();
@@ -281,6 +289,7 @@ main(int argc, char *argv[])
 		t.join();
 
 	auto end = high_resolution_clock::now();
+	map->stop_refiller();
 	auto elapsed = (end - start).count() / 1000000000.0;
 	auto throughput = op_total / elapsed;
 	printf("Run phase finished in %f seconds\n", elapsed);
@@ -302,9 +311,8 @@ main(int argc, char *argv[])
 		del_fail += t.del_fail;
 	}
 
-	uint64_t total_slots = map->capacity();
-	printf("capacity (after insertion) %ld, load factor %f\n", total_slots,
-	       (loaded + inserted) * 1.0 / total_slots);
+	printf("capacity (after insertion) %ld, %ld items, load factor %f\n",
+	       map->capacity(), map->size(), map->load_factor());
 
 	printf("Insert operations: %ld loaded, %ld inserted, %ld failed\n",
 	       loaded, inserted, ins_fail);
@@ -313,6 +321,8 @@ main(int argc, char *argv[])
 	       del_fail);
 	printf("Update operations: %ld updated, %ld failed\n", updated,
 	       upd_fail);
+	printf("Key compares on false token matches: %ld\n",
+	       map->false_matches());
 
 #ifdef LATENCY_ENABLE
 	std::ofstream ofs_latency("nrhi_latency.res");
@@ -334,5 +344,7 @@ main(int argc, char *argv[])
 	printf("Average latency: %f (ns)\n", avg_latency);
 #endif
 
+	map->close();
+	pop.close();
 	return 0;
 }
@@ -0,0 +1,3 @@
+#define BUCKET_SLOTS 32
+#define BUCKET_ALIGN 256
+#include "nrhi_test_ycsb.cpp"
\ No newline at end of file